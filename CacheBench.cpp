@@ -0,0 +1,185 @@
+#include <markercache.h>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using namespace std;
+
+// Benchmarks of the cache operations over a sweep of filter sizes, key widths
+// and numbers of filters. Results go to stdout as CSV, one line per operation
+// and configuration, progress goes to stderr.
+//
+// CacheBench [max_markers_per_filter]
+//
+// Filters hold from 16k markers, small enough to stay in L2, up to the given
+// number, 4M by default. 1G markers makes filters of about 2GB each.
+
+// Keys inserted into every filter and looked up, larger filters are only
+// partly filled so the key pools stay in memory
+static const size_t max_pool = 1 << 18;
+// Lookups timed per variant, and markers per batch
+static const size_t num_lookups = 1 << 17;
+static const size_t batch_size = 1024;
+static const double bench_fprate = 0.001;
+
+struct key_pool {
+    vector<char> bytes;
+    vector<marker_cache::marker> markers;
+};
+
+// n random keys of width bytes
+static key_pool generate_keys(size_t n, size_t width, mt19937_64 &rng) {
+    key_pool pool;
+    pool.bytes.resize(n * width);
+    for (size_t i = 0; i < pool.bytes.size(); ++i) pool.bytes[i] = rng();
+    for (size_t i = 0; i < n; ++i)
+        pool.markers.push_back(
+            marker_cache::marker(&pool.bytes[i * width], width));
+    return pool;
+}
+
+static uint64_t now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+               chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+struct config {
+    size_t capacity;
+    size_t width;
+    size_t num_filters;
+};
+
+static void report(const char *op, const config &c, size_t ops,
+                   uint64_t ns) {
+    double seconds = ns / 1e9;
+    cout << op << ',' << c.capacity << ',' << c.width << ',' << c.num_filters
+         << ',' << ops << ',' << seconds << ','
+         << (seconds > 0 ? ops / seconds : 0) << ','
+         << (ops ? (double)ns / ops : 0) << endl;
+}
+
+// Time single lookups of every key in keys, cycling through them
+static void time_lookups(const char *op, const config &c, marker_cache &m,
+                         time_t start, time_t end, const key_pool &keys) {
+    size_t found = 0;
+    uint64_t started = now_ns();
+    for (size_t i = 0; i < num_lookups; ++i) {
+        const marker_cache::marker &k = keys.markers[i % keys.markers.size()];
+        found += m.lookup_from(start, end, k.first, k.second);
+    }
+    report(op, c, num_lookups, now_ns() - started);
+    // Keep the lookups from being optimised away
+    if (found > num_lookups) abort();
+}
+
+// Time batch lookups of hits and misses alternating
+static void time_batches(const char *op, const config &c, marker_cache &m,
+                         time_t start, time_t end, const key_pool &hits,
+                         const key_pool &misses) {
+    vector<marker_cache::marker> batch(batch_size);
+    size_t found = 0, ops = 0;
+    uint64_t started = now_ns();
+    for (size_t i = 0; ops < num_lookups; ++i) {
+        for (size_t j = 0; j < batch_size; ++j) {
+            const key_pool &keys = j % 2 ? misses : hits;
+            batch[j] = keys.markers[(i * batch_size / 2 + j / 2) %
+                                    keys.markers.size()];
+        }
+        found += m.lookup_from_batch(start, end, &batch[0], batch_size).count();
+        ops += batch_size;
+    }
+    report(op, c, ops, now_ns() - started);
+    if (found > ops) abort();
+}
+
+static void run(const config &c, mt19937_64 &rng) {
+    cerr << "capacity " << c.capacity << ", width " << c.width << ", "
+         << c.num_filters << " filters" << endl;
+    size_t dur = 1;
+    size_t lifespan = c.num_filters - 1;
+    marker_cache::options opts;
+    opts.name = "bench";
+
+    key_pool hits = generate_keys(min(c.capacity, max_pool), c.width, rng);
+    key_pool misses = generate_keys(min(c.capacity, max_pool), c.width, rng);
+    size_t half = hits.markers.size() / 2;
+
+    boost::filesystem::remove_all("archive/bench");
+    marker_cache *m = new marker_cache(dur, lifespan, bench_fprate,
+                                       c.capacity * c.num_filters, opts);
+
+    // Fill every filter, half of the keys one by one and half in a batch,
+    // and age it out
+    uint64_t insert_ns = 0, batch_ns = 0, age_ns = 0;
+    for (size_t f = 0; f < c.num_filters; ++f) {
+        uint64_t started = now_ns();
+        for (size_t i = 0; i < half; ++i)
+            m->insert(hits.markers[i].first, hits.markers[i].second);
+        insert_ns += now_ns() - started;
+        started = now_ns();
+        m->insert_batch(&hits.markers[half], hits.markers.size() - half);
+        batch_ns += now_ns() - started;
+        started = now_ns();
+        m->maybe_age(true);
+        age_ns += now_ns() - started;
+        // Leave the disk writes out of the next timings
+        m->flush();
+    }
+    report("insert", c, half * c.num_filters, insert_ns);
+    report("insert_batch", c, (hits.markers.size() - half) * c.num_filters,
+           batch_ns);
+    report("age", c, c.num_filters, age_ns);
+
+    // A narrow lookup covers the newest sealed filter, a wide one them all
+    vector<marker_cache::filter_statistics> filters = m->filter_stats();
+    marker_cache::timerange narrow = filters[filters.size() - 2].range;
+    time_t wide_end = (numeric_limits<time_t>::max)();
+    time_lookups("lookup_narrow_hit", c, *m, narrow.first, narrow.second,
+                 hits);
+    time_lookups("lookup_narrow_miss", c, *m, narrow.first, narrow.second,
+                 misses);
+    time_lookups("lookup_wide_hit", c, *m, 0, wide_end, hits);
+    time_lookups("lookup_wide_miss", c, *m, 0, wide_end, misses);
+    time_batches("lookup_batch_narrow", c, *m, narrow.first, narrow.second,
+                 hits, misses);
+    time_batches("lookup_batch_wide", c, *m, 0, wide_end, hits, misses);
+
+    // Write every sealed filter again
+    boost::filesystem::remove_all("archive/bench");
+    uint64_t started = now_ns();
+    m->save();
+    m->flush();
+    report("save", c, filters.size() - 1, now_ns() - started);
+
+    // Load them back into a new cache
+    delete m;
+    started = now_ns();
+    m = new marker_cache(dur, lifespan, bench_fprate,
+                         c.capacity * c.num_filters, opts);
+    m->wait_loaded();
+    report("load", c, 1, now_ns() - started);
+    delete m;
+    boost::filesystem::remove_all("archive/bench");
+}
+
+int main(int argc, char **argv) {
+    size_t max_capacity = argc > 1 ? strtoull(argv[1], NULL, 10) : 1 << 22;
+    const size_t widths[] = {16, 64, 256};
+    const size_t num_filters[] = {2, 5, 17};
+    mt19937_64 rng(42);
+
+    cout << "op,markers_per_filter,key_width,num_filters,ops,seconds,"
+            "ops_per_sec,ns_per_op"
+         << endl;
+    for (size_t capacity = 1 << 14; capacity <= max_capacity; capacity *= 16)
+        for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); ++w)
+            for (size_t n = 0; n < sizeof(num_filters) / sizeof(num_filters[0]);
+                 ++n) {
+                config c = {capacity, widths[w], num_filters[n]};
+                run(c, rng);
+            }
+    return 0;
+}
@@ -0,0 +1,58 @@
+#include <markercache.h>
+#include <cstdio>
+#include <iostream>
+
+using namespace std;
+
+// Print the non empty buckets of a latency histogram
+static void print_histogram(const char *name, const uint64_t *buckets) {
+    cout << name << " latency:" << endl;
+    for (size_t b = 0; b < marker_cache::num_latency_buckets; ++b) {
+        if (!buckets[b]) continue;
+        uint64_t low = b ? uint64_t(1) << (b - 1) : 0;
+        cout << "  < " << (uint64_t(1) << b) << " ns (>= " << low
+             << "): " << buckets[b] << endl;
+    }
+}
+
+// Print the counters and filters of a running cache, CacheStats [name]
+int main(int argc, char **argv) {
+    string name = argc > 1 ? argv[1] : "";
+    marker_cache m(name);
+
+    marker_cache::statistics s;
+    if (m.stats(s)) {
+        cout << "lookups: " << s.lookups << endl;
+        cout << "hits: " << s.hits << endl;
+        cout << "filters probed per lookup: "
+             << (s.lookups ? (double)s.filters_probed / s.lookups : 0)
+             << endl;
+        cout << "inserts: " << s.inserts << endl;
+        cout << "ageing cycles: " << s.ageing_cycles << endl;
+        cout << "saves: " << s.saves << " taking "
+             << (double)s.save_ns / 1e6 << " ms" << endl;
+        print_histogram("lookup", s.lookup_latency);
+        print_histogram("insert", s.insert_latency);
+        print_histogram("ageing", s.age_latency);
+        print_histogram("save", s.save_latency);
+    } else {
+        cout << "The cache keeps no statistics" << endl;
+    }
+
+    vector<marker_cache::filter_statistics> filters = m.filter_stats();
+    cout << "filters:" << endl;
+    for (size_t i = 0; i < filters.size(); ++i) {
+        const marker_cache::filter_statistics &f = filters[i];
+        cout << "  " << f.range.first << " -> " << f.range.second;
+        if (f.loading) {
+            cout << " loading" << endl;
+            continue;
+        }
+        char line[128];
+        snprintf(line, sizeof(line),
+                 " stages %zu bits %zu fill %.4f fp rate %.3g", f.stages,
+                 f.bits, f.fill, f.fp_rate);
+        cout << line << endl;
+    }
+    return 0;
+}
@@ -0,0 +1,288 @@
+#include <markercache.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// One writer process inserting and ageing the cache as DBApp does, and
+// reader processes attached to it looking markers up as SD does. Reports the
+// throughput and the lookup latency percentiles, over the whole run and split
+// into the windows where the writer was running an ageing cycle and the rest.
+//
+// ContentionBench [readers] [threads] [lookups_per_sec] [inserts_per_sec]
+//                 [age_every_sec] [seconds]
+//
+// Rates are per reader thread and for the writer. Each lookup is timed from
+// its call, a reader which falls behind its schedule catches up without
+// sleeping.
+
+static const char *const cache_name = "contention";
+// Markers inserted before the readers start, which they look up as hits
+static const size_t prefill = 1 << 16;
+// Most sleeps between writer batches
+static const chrono::milliseconds insert_tick(1);
+
+struct settings {
+    size_t readers;
+    size_t threads;
+    double lookups_per_sec;
+    double inserts_per_sec;
+    double age_every_sec;
+    double seconds;
+};
+
+// A lookup started at start, in steady clock nanoseconds, taking ns
+struct sample {
+    uint64_t start;
+    uint64_t ns;
+};
+
+// Writer ageing cycle from start to end
+struct window {
+    uint64_t start;
+    uint64_t end;
+};
+
+static uint64_t now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+               chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// Marker i, misses have the top bit set and are never inserted
+struct key {
+    uint64_t words[2];
+    explicit key(uint64_t i) {
+        // splitmix64
+        uint64_t z = i + 0x9e3779b97f4a7c15ULL;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        words[0] = i;
+        words[1] = z ^ (z >> 31);
+    }
+};
+
+static void write_all(int fd, const void *data, size_t bytes) {
+    const char *p = static_cast<const char *>(data);
+    while (bytes) {
+        ssize_t n = write(fd, p, bytes);
+        if (n <= 0) _exit(2);
+        p += n;
+        bytes -= n;
+    }
+}
+
+// Read everything written to fd until it is closed
+static vector<char> read_all(int fd) {
+    vector<char> data;
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        data.insert(data.end(), buf, buf + n);
+    return data;
+}
+
+// Insert at the given rate and age on schedule until stop is readable, then
+// send the ageing windows to out
+static void run_writer(const settings &s, int ready, int stop, int out) {
+    // Filters hold twice the markers inserted in an ageing period
+    size_t dur = 1, lifespan = 5;
+    size_t num_filters = lifespan / dur + 1;
+    size_t capacity = max<size_t>(
+        prefill, 2 * s.inserts_per_sec * s.age_every_sec);
+    marker_cache::options opts;
+    opts.name = cache_name;
+    boost::filesystem::remove_all(string("archive/") + cache_name);
+    vector<window> windows;
+    {
+        marker_cache m(dur, lifespan, 0.001, capacity * num_filters, opts);
+        uint64_t i = 0;
+        for (; i < prefill; ++i) {
+            key k(i);
+            m.insert(k.words, sizeof(k.words));
+        }
+        write_all(ready, "r", 1);
+
+        uint64_t started = now_ns();
+        uint64_t next_age = started + s.age_every_sec * 1e9;
+        pollfd p = {stop, POLLIN, 0};
+        while (poll(&p, 1, 0) == 0) {
+            uint64_t now = now_ns();
+            uint64_t due =
+                prefill + (now - started) / 1e9 * s.inserts_per_sec;
+            for (; i < due; ++i) {
+                key k(i);
+                m.insert(k.words, sizeof(k.words));
+            }
+            if (now >= next_age) {
+                window w;
+                w.start = now_ns();
+                m.maybe_age(true);
+                w.end = now_ns();
+                windows.push_back(w);
+                next_age += s.age_every_sec * 1e9;
+            }
+            this_thread::sleep_for(insert_tick);
+        }
+        m.flush();
+    }
+    boost::filesystem::remove_all(string("archive/") + cache_name);
+    write_all(out, windows.data(), windows.size() * sizeof(window));
+}
+
+// Look markers up from every thread at the given rate, half of them hits,
+// and send the samples to out
+static void run_reader(const settings &s, size_t reader, int out) {
+    marker_cache m(cache_name);
+    vector<vector<sample> > samples(s.threads);
+    vector<thread> threads;
+    for (size_t t = 0; t < s.threads; ++t)
+        threads.push_back(thread([&, t]() {
+            mt19937_64 rng(reader * s.threads + t);
+            vector<sample> &v = samples[t];
+            v.reserve(s.lookups_per_sec * s.seconds + 1);
+            chrono::steady_clock::time_point next = chrono::steady_clock::now();
+            chrono::nanoseconds interval(uint64_t(1e9 / s.lookups_per_sec));
+            uint64_t end = now_ns() + s.seconds * 1e9;
+            size_t found = 0;
+            for (size_t j = 0; now_ns() < end; ++j) {
+                this_thread::sleep_until(next);
+                next += interval;
+                uint64_t i = rng() % prefill;
+                if (j % 2) i |= uint64_t(1) << 63;
+                key k(i);
+                sample x;
+                x.start = now_ns();
+                found += m.lookup_from(0, (numeric_limits<time_t>::max)(),
+                                       k.words, sizeof(k.words));
+                x.ns = now_ns() - x.start;
+                v.push_back(x);
+            }
+            if (found > v.size()) abort();
+        }));
+    for (size_t t = 0; t < s.threads; ++t) threads[t].join();
+    for (size_t t = 0; t < s.threads; ++t)
+        write_all(out, samples[t].data(), samples[t].size() * sizeof(sample));
+}
+
+static void report(const char *name, vector<uint64_t> &ns) {
+    sort(ns.begin(), ns.end());
+    const double quantiles[] = {0.5, 0.99, 0.999};
+    printf("%-8s %10zu", name, ns.size());
+    for (size_t q = 0; q < 3; ++q)
+        printf(" %10llu",
+               ns.empty() ? 0ULL
+                          : (unsigned long long)ns[min(
+                                ns.size() - 1,
+                                size_t(quantiles[q] * ns.size()))]);
+    printf("\n");
+}
+
+int main(int argc, char **argv) {
+    settings s = {4, 1, 10000, 100000, 2, 10};
+    if (argc > 1) s.readers = atoi(argv[1]);
+    if (argc > 2) s.threads = atoi(argv[2]);
+    if (argc > 3) s.lookups_per_sec = atof(argv[3]);
+    if (argc > 4) s.inserts_per_sec = atof(argv[4]);
+    if (argc > 5) s.age_every_sec = atof(argv[5]);
+    if (argc > 6) s.seconds = atof(argv[6]);
+
+    // The parent only forks and collects, it never maps the cache
+    int ready[2], stop[2], out[2];
+    if (pipe(ready) || pipe(stop) || pipe(out)) return 1;
+    pid_t writer = fork();
+    if (writer == 0) {
+        close(ready[0]);
+        close(stop[1]);
+        close(out[0]);
+        run_writer(s, ready[1], stop[0], out[1]);
+        _exit(0);
+    }
+    close(ready[1]);
+    close(stop[0]);
+    close(out[1]);
+    char c;
+    if (read(ready[0], &c, 1) != 1) {
+        cerr << "Writer failed to create the cache" << endl;
+        return 1;
+    }
+
+    vector<pid_t> readers;
+    vector<int> results;
+    uint64_t started = now_ns();
+    for (size_t r = 0; r < s.readers; ++r) {
+        int fds[2];
+        if (pipe(fds)) return 1;
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fds[0]);
+            close(stop[1]);
+            close(out[0]);
+            run_reader(s, r, fds[1]);
+            _exit(0);
+        }
+        close(fds[1]);
+        readers.push_back(pid);
+        results.push_back(fds[0]);
+    }
+
+    vector<sample> samples;
+    for (size_t r = 0; r < readers.size(); ++r) {
+        vector<char> data = read_all(results[r]);
+        const sample *p = reinterpret_cast<const sample *>(data.data());
+        samples.insert(samples.end(), p, p + data.size() / sizeof(sample));
+        close(results[r]);
+        int status;
+        waitpid(readers[r], &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status))
+            cerr << "Reader " << r << " failed" << endl;
+    }
+    double elapsed = (now_ns() - started) / 1e9;
+    close(stop[1]);
+    vector<char> data = read_all(out[0]);
+    const window *w = reinterpret_cast<const window *>(data.data());
+    vector<window> windows(w, w + data.size() / sizeof(window));
+    int status;
+    waitpid(writer, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+        cerr << "Writer failed" << endl;
+
+    // A lookup overlapping an ageing cycle falls in the ageing window
+    vector<uint64_t> all, ageing, steady;
+    for (size_t i = 0; i < samples.size(); ++i) {
+        const sample &x = samples[i];
+        bool overlaps = false;
+        for (size_t j = 0; j < windows.size() && !overlaps; ++j)
+            overlaps = x.start <= windows[j].end &&
+                       x.start + x.ns >= windows[j].start;
+        all.push_back(x.ns);
+        (overlaps ? ageing : steady).push_back(x.ns);
+    }
+    uint64_t age_ns = 0;
+    for (size_t j = 0; j < windows.size(); ++j)
+        age_ns += windows[j].end - windows[j].start;
+
+    printf("%zu readers x %zu threads at %.0f lookups/s, writer at %.0f "
+           "inserts/s ageing every %.1f s\n",
+           s.readers, s.threads, s.lookups_per_sec, s.inserts_per_sec,
+           s.age_every_sec);
+    printf("%zu lookups in %.2f s, %.0f lookups/s\n", samples.size(), elapsed,
+           samples.size() / elapsed);
+    printf("%zu ageing cycles, %.3f ms each\n", windows.size(),
+           windows.empty() ? 0 : age_ns / 1e6 / windows.size());
+    printf("%-8s %10s %10s %10s %10s\n", "window", "lookups", "p50_ns",
+           "p99_ns", "p999_ns");
+    report("all", all);
+    report("ageing", ageing);
+    report("steady", steady);
+    return 0;
+}
@@ -1,6 +1,8 @@
 #define BOOST_TEST_MODULE MarkerCacheTest
+#include <cacherouter.h>
 #include <markercache.h>
 #include <boost/test/included/unit_test.hpp>
+#include <thread>
 #include <vector>
 
 using namespace std;
@@ -32,6 +34,9 @@ struct GeneratedMarkerCache {
 
         size_t num_filters = ceil((double)lifespan / (double)dur) + 1;
 
+        // Start from an empty archive, the filters of earlier tests would
+        // otherwise be recovered
+        boost::filesystem::remove_all("archive");
         m = new marker_cache(dur, lifespan, test_fprate,
                              test_size * num_filters);
 
@@ -124,6 +129,240 @@ BOOST_AUTO_TEST_CASE(FalsePositiveRate) {
     BOOST_CHECK_CLOSE(test_fprate, observed_fprate, 30);
 }
 
+BOOST_AUTO_TEST_CASE(BlockedFalsePositiveRate) {
+    size_t num_filters = ceil((double)lifespan / (double)dur) + 1;
+    marker_cache::options opts;
+    opts.blocked = true;
+
+    delete m;
+    m = new marker_cache(dur, lifespan, test_fprate, test_size * num_filters,
+                         opts);
+
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != test_set_one.cend(); ++i) {
+        BOOST_CHECK_NO_THROW(m->insert(i->first, i->second));
+        BOOST_CHECK_MESSAGE(lookup_from_current(i->first, i->second),
+                            "False Negative - fatal error");
+    }
+
+    size_t falsepos = 0;
+
+    for (vector<pair<char*, int>>::const_iterator i = test_set_two.cbegin();
+         i != test_set_two.cend(); ++i)
+        if (lookup_from_current(i->first, i->second)) ++falsepos;
+
+    double observed_fprate = (double)falsepos / (double)test_size;
+
+    // The filters are grown to compensate for the blocked layout
+    BOOST_CHECK_CLOSE(test_fprate, observed_fprate, 30);
+}
+
+BOOST_AUTO_TEST_CASE(HashPolicy) {
+    size_t num_filters = ceil((double)lifespan / (double)dur) + 1;
+    marker_cache::options opts;
+    opts.hash = bf::hash_mum;
+
+    // Archive a filter built with MurmurHash3
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != test_set_one.cend(); ++i)
+        BOOST_CHECK_NO_THROW(m->insert(i->first, i->second));
+    m->maybe_age(true);
+    delete m;
+
+    // New filters use the faster hash, the archived one keeps its own. The
+    // checkpointed current filter is resumed, age past it.
+    m = new marker_cache(dur, lifespan, test_fprate, test_size * num_filters,
+                         opts);
+    m->maybe_age(true);
+    for (vector<pair<char*, int>>::const_iterator i = test_set_two.cbegin();
+         i != test_set_two.cend(); ++i)
+        BOOST_CHECK_NO_THROW(m->insert(i->first, i->second));
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != test_set_one.cend(); ++i)
+        BOOST_CHECK(lookup_from_all(i->first, i->second));
+    for (vector<pair<char*, int>>::const_iterator i = test_set_two.cbegin();
+         i != test_set_two.cend(); ++i)
+        BOOST_CHECK(lookup_from_current(i->first, i->second));
+
+    // The faster hash keeps the target false positive rate
+    size_t falsepos = 0;
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != test_set_one.cend(); ++i)
+        if (lookup_from_current(i->first, i->second)) ++falsepos;
+    BOOST_CHECK_CLOSE(test_fprate, (double)falsepos / (double)test_size, 30);
+}
+
+BOOST_AUTO_TEST_CASE(HighHashCount) {
+    size_t num_filters = ceil((double)lifespan / (double)dur) + 1;
+
+    // More hash functions than there are specialised kernels for, the
+    // checkpoint of the default cache would be resumed
+    delete m;
+    boost::filesystem::remove_all("archive");
+    m = new marker_cache(dur, lifespan, 1e-6, test_size * num_filters);
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != test_set_one.cend(); ++i) {
+        BOOST_CHECK_NO_THROW(m->insert(i->first, i->second));
+        BOOST_CHECK_MESSAGE(lookup_from_current(i->first, i->second),
+                            "False Negative - fatal error");
+    }
+    size_t falsepos = 0;
+    for (vector<pair<char*, int>>::const_iterator i = test_set_two.cbegin();
+         i != test_set_two.cend(); ++i)
+        if (lookup_from_current(i->first, i->second)) ++falsepos;
+    BOOST_CHECK_LE(falsepos, 5);
+}
+
+BOOST_AUTO_TEST_CASE(StageRollover) {
+    size_t num_filters = ceil((double)lifespan / (double)dur) + 1;
+    marker_cache::options opts;
+    opts.stage_headroom = 8;
+
+    // A burst of four times the design load of a filter is spread over
+    // chained stages instead of overfilling it
+    delete m;
+    boost::filesystem::remove_all("archive");
+    m = new marker_cache(dur, lifespan, test_fprate,
+                         test_size / 4 * num_filters, opts);
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != test_set_one.cend(); ++i)
+        BOOST_CHECK_NO_THROW(m->insert(i->first, i->second));
+    size_t falsepos = 0;
+    for (vector<pair<char*, int>>::const_iterator i = test_set_two.cbegin();
+         i != test_set_two.cend(); ++i)
+        if (lookup_from_current(i->first, i->second)) ++falsepos;
+    BOOST_CHECK_LT((double)falsepos / test_size, 2 * test_fprate);
+
+    // Every stage is archived and loaded back with its filter
+    m->maybe_age(true);
+    m->flush();
+    delete m;
+    m = new marker_cache(dur, lifespan, test_fprate,
+                         test_size / 4 * num_filters, opts);
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != test_set_one.cend(); ++i)
+        BOOST_CHECK_MESSAGE(lookup_from_all(i->first, i->second),
+                            "False Negative - fatal error");
+}
+
+BOOST_AUTO_TEST_CASE(AdaptiveSizing) {
+    size_t num_filters = ceil((double)lifespan / (double)dur) + 1;
+    marker_cache::options opts;
+    opts.adaptive_sizing = true;
+
+    // The first period gets twice the markers it was sized for, the stages
+    // it needs come from the memory the backdated empty filters leave
+    delete m;
+    boost::filesystem::remove_all("archive");
+    m = new marker_cache(dur, lifespan, test_fprate,
+                         test_size / 2 * num_filters, opts);
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != test_set_one.cend(); ++i)
+        BOOST_CHECK_NO_THROW(m->insert(i->first, i->second));
+
+    size_t falsepos = 0;
+    for (vector<pair<char*, int>>::const_iterator i = test_set_two.cbegin();
+         i != test_set_two.cend(); ++i)
+        if (lookup_from_current(i->first, i->second)) ++falsepos;
+    BOOST_CHECK_LT((double)falsepos / test_size, 2 * test_fprate);
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != test_set_one.cend(); ++i)
+        BOOST_CHECK_MESSAGE(lookup_from_all(i->first, i->second),
+                            "False Negative - fatal error");
+
+    // Later periods are sized from what was seen and fit in what is left
+    for (size_t j = 0; j < num_filters; ++j) m->maybe_age(true);
+    for (vector<pair<char*, int>>::const_iterator i = test_set_two.cbegin();
+         i != test_set_two.cbegin() + 100; ++i)
+        BOOST_CHECK_NO_THROW(m->insert(i->first, i->second));
+    for (vector<pair<char*, int>>::const_iterator i = test_set_two.cbegin();
+         i != test_set_two.cbegin() + 100; ++i)
+        BOOST_CHECK(lookup_from_current(i->first, i->second));
+}
+
+BOOST_AUTO_TEST_CASE(FoldedFilters) {
+    size_t num_filters = ceil((double)lifespan / (double)dur) + 1;
+    marker_cache::options opts;
+    opts.fold_after = 1;
+    opts.max_folds = 1;
+
+    // Filters sealed for more than a period are folded in half, the memory
+    // of four filters then holds three times the lifespan
+    delete m;
+    boost::filesystem::remove_all("archive");
+    m = new marker_cache(dur, 3 * lifespan, test_fprate,
+                         test_size * num_filters, opts);
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != test_set_one.cend(); ++i)
+        BOOST_CHECK_NO_THROW(m->insert(i->first, i->second));
+    for (size_t j = 0; j < num_filters; ++j) m->maybe_age(true);
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != test_set_one.cend(); ++i)
+        BOOST_CHECK_MESSAGE(lookup_from_all(i->first, i->second),
+                            "False Negative - fatal error");
+    size_t falsepos = 0;
+    for (vector<pair<char*, int>>::const_iterator i = test_set_two.cbegin();
+         i != test_set_two.cend(); ++i)
+        if (lookup_from_all(i->first, i->second)) ++falsepos;
+    BOOST_CHECK_LT((double)falsepos / test_size, 0.1);
+
+    // Folded filters are archived at their folded size and loaded back
+    m->flush();
+    delete m;
+    m = new marker_cache(dur, 3 * lifespan, test_fprate,
+                         test_size * num_filters, opts);
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != test_set_one.cend(); ++i)
+        BOOST_CHECK_MESSAGE(lookup_from_all(i->first, i->second),
+                            "False Negative - fatal error");
+}
+
+BOOST_AUTO_TEST_CASE(SummaryFilters) {
+    size_t num_filters = ceil((double)lifespan / (double)dur) + 1;
+    marker_cache::options opts;
+    opts.summary_group = 2;
+
+    // Wide lookups skip the filters whose summary rules a marker out, but
+    // never those of a marker inserted into them
+    delete m;
+    boost::filesystem::remove_all("archive");
+    m = new marker_cache(dur, lifespan, test_fprate, test_size * num_filters,
+                         opts);
+    size_t step = test_size / (2 * num_filters);
+    for (size_t j = 0; j < 2 * num_filters; ++j) {
+        for (vector<pair<char*, int>>::const_iterator i =
+                 test_set_one.cbegin() + j * step;
+             i != test_set_one.cbegin() + (j + 1) * step; ++i)
+            BOOST_CHECK_NO_THROW(m->insert(i->first, i->second));
+        // Only the filters still in the lifespan are looked for
+        size_t kept = std::min(j + 1, num_filters);
+        for (vector<pair<char*, int>>::const_iterator i =
+                 test_set_one.cbegin() + (j + 1 - kept) * step;
+             i != test_set_one.cbegin() + (j + 1) * step; ++i)
+            BOOST_CHECK_MESSAGE(lookup_from_all(i->first, i->second),
+                                "False Negative - fatal error");
+        m->maybe_age(true);
+    }
+
+    size_t falsepos = 0;
+    for (vector<pair<char*, int>>::const_iterator i = test_set_two.cbegin();
+         i != test_set_two.cend(); ++i)
+        if (lookup_from_all(i->first, i->second)) ++falsepos;
+    BOOST_CHECK_LT((double)falsepos / test_size, num_filters * test_fprate);
+
+    // Batches skip the same filters and give the same answers
+    vector<marker_cache::marker> batch(test_set_one.cbegin(),
+                                       test_set_one.cend());
+    batch.insert(batch.end(), test_set_two.cbegin(), test_set_two.cend());
+    boost::dynamic_bitset<> found = m->lookup_from_batch(
+        0, (std::numeric_limits<time_t>::max)(), &batch[0], batch.size());
+    size_t mismatches = 0;
+    for (size_t j = 0; j < batch.size(); ++j)
+        if (found[j] != lookup_from_all((char*)batch[j].first, batch[j].second))
+            ++mismatches;
+    BOOST_CHECK_EQUAL(mismatches, 0);
+}
+
 BOOST_AUTO_TEST_CASE(Ageing) {
     size_t num_filters = ceil((double)lifespan / (double)dur) + 1;
 
@@ -157,6 +396,27 @@ BOOST_AUTO_TEST_CASE(Ageing) {
         BOOST_CHECK(!lookup_from_all(i->first, i->second));
 }
 
+BOOST_AUTO_TEST_CASE(LookupsDuringAgeing) {
+    size_t num_filters = ceil((double)lifespan / (double)dur) + 1;
+
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != test_set_one.cend(); ++i)
+        BOOST_CHECK_NO_THROW(m->insert(i->first, i->second));
+
+    // Readers take no locks, they must never miss data while the filters are
+    // republished underneath them
+    thread ageing([this, num_filters]() {
+        for (size_t i = 0; i < num_filters - 1; ++i) m->maybe_age(true);
+    });
+    size_t missed = 0;
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != test_set_one.cend(); ++i)
+        if (!lookup_from_all(i->first, i->second)) ++missed;
+    ageing.join();
+
+    BOOST_CHECK_EQUAL(missed, 0);
+}
+
 BOOST_AUTO_TEST_CASE(TimerangeLookups) {
     for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
          i != test_set_one.cend(); ++i) {
@@ -173,6 +433,659 @@ BOOST_AUTO_TEST_CASE(TimerangeLookups) {
     }
 }
 
+BOOST_AUTO_TEST_CASE(BatchLookups) {
+    vector<marker_cache::marker> batch_one, batch_two;
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != test_set_one.cend(); ++i) {
+        BOOST_CHECK_NO_THROW(m->insert(i->first, i->second));
+        batch_one.push_back(marker_cache::marker(i->first, i->second));
+    }
+    for (vector<pair<char*, int>>::const_iterator i = test_set_two.cbegin();
+         i != test_set_two.cend(); ++i)
+        batch_two.push_back(marker_cache::marker(i->first, i->second));
+
+    boost::dynamic_bitset<> found = m->lookup_from_batch(
+        0, (std::numeric_limits<time_t>::max)(), &batch_one[0], test_size);
+    BOOST_CHECK_MESSAGE(found.all(), "False Negative - fatal error");
+
+    // Batched results must agree with single lookups
+    found = m->lookup_from_batch(0, (std::numeric_limits<time_t>::max)(),
+                                 &batch_two[0], test_size);
+    for (size_t i = 0; i < test_size; ++i)
+        BOOST_CHECK_EQUAL(found[i], lookup_from_all(test_set_two[i].first,
+                                                    test_set_two[i].second));
+
+    found = m->lookup_from_batch(0, time(NULL) - 100, &batch_one[0], test_size);
+    BOOST_CHECK(found.none());
+}
+
+BOOST_AUTO_TEST_CASE(BatchInserts) {
+    vector<marker_cache::marker> batch;
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != test_set_one.cend(); ++i)
+        batch.push_back(marker_cache::marker(i->first, i->second));
+
+    BOOST_CHECK_NO_THROW(m->insert_batch(&batch[0], batch.size()));
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != test_set_one.cend(); ++i)
+        BOOST_CHECK_MESSAGE(lookup_from_current(i->first, i->second),
+                            "False Negative - fatal error");
+}
+
+BOOST_AUTO_TEST_CASE(MultiWriterInserts) {
+    size_t num_filters = ceil((double)lifespan / (double)dur) + 1;
+    size_t num_threads = 4;
+    marker_cache::options opts;
+    opts.multi_writer = true;
+
+    delete m;
+    m = new marker_cache(dur, lifespan, test_fprate, test_size * num_filters,
+                         opts);
+
+    // Interleave the writers over the same words of the current filter
+    vector<thread> writers;
+    for (size_t t = 0; t < num_threads; ++t)
+        writers.push_back(thread([this, t, num_threads]() {
+            for (size_t i = t; i < test_size; i += num_threads)
+                m->insert(test_set_one[i].first, test_set_one[i].second);
+        }));
+    for (size_t t = 0; t < num_threads; ++t) writers[t].join();
+
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != test_set_one.cend(); ++i)
+        BOOST_CHECK_MESSAGE(lookup_from_current(i->first, i->second),
+                            "False Negative - fatal error");
+}
+
+BOOST_AUTO_TEST_CASE(MultiWriterAgeing) {
+    size_t num_filters = ceil((double)lifespan / (double)dur) + 1;
+    size_t num_threads = 4;
+    marker_cache::options opts;
+    opts.multi_writer = true;
+    opts.fold_after = 1;
+    opts.stage_headroom = 1;
+
+    // Writers keep inserting, chaining stages, while ageing folds the sealed
+    // filters and compacts the slab under them. Every marker stays within
+    // the lifespan.
+    delete m;
+    boost::filesystem::remove_all("archive");
+    m = new marker_cache(dur, lifespan, test_fprate, test_size * num_filters,
+                         opts);
+    vector<pair<char*, int>> markers(test_set_one);
+    markers.insert(markers.end(), test_set_two.cbegin(), test_set_two.cend());
+    atomic<size_t> inserted(0);
+    vector<thread> writers;
+    for (size_t t = 0; t < num_threads; ++t)
+        writers.push_back(
+            thread([this, t, num_threads, &markers, &inserted]() {
+                for (size_t i = t; i < markers.size(); i += num_threads) {
+                    m->insert(markers[i].first, markers[i].second);
+                    ++inserted;
+                }
+            }));
+    // The first period takes more than its design load. Cycles are spaced
+    // out as they would be, inserts only race with the one sealing their
+    // filter.
+    for (size_t j = 0; j + 1 < num_filters; ++j) {
+        while (inserted < markers.size() * (60 + 15 * j) / 100)
+            this_thread::yield();
+        m->maybe_age(true);
+        this_thread::sleep_for(chrono::milliseconds(100));
+    }
+    for (size_t t = 0; t < num_threads; ++t) writers[t].join();
+
+    for (vector<pair<char*, int>>::const_iterator i = markers.cbegin();
+         i != markers.cend(); ++i)
+        BOOST_CHECK_MESSAGE(lookup_from_all(i->first, i->second),
+                            "False Negative - fatal error");
+}
+
+BOOST_AUTO_TEST_CASE(NarrowTimerangeLookups) {
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != test_set_one.cend(); ++i)
+        BOOST_CHECK_NO_THROW(m->insert(i->first, i->second));
+    m->maybe_age(true);
+
+    // The data now only lives in the filter sealed by the ageing cycle
+    size_t current_hits = 0;
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != test_set_one.cend(); ++i) {
+        BOOST_CHECK(lookup_from_all(i->first, i->second));
+        if (lookup_from_current(i->first, i->second)) ++current_hits;
+    }
+    BOOST_CHECK_LT(current_hits, test_size / 100);
+}
+
+BOOST_AUTO_TEST_CASE(ArchivedFilters) {
+    size_t num_filters = ceil((double)lifespan / (double)dur) + 1;
+
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != test_set_one.cend(); ++i)
+        BOOST_CHECK_NO_THROW(m->insert(i->first, i->second));
+    m->maybe_age(true);
+
+    // A new cache loads the sealed filter back from disk
+    delete m;
+    m = new marker_cache(dur, lifespan, test_fprate, test_size * num_filters);
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != test_set_one.cend(); ++i)
+        BOOST_CHECK(lookup_from_all(i->first, i->second));
+
+    // A corrupted archive fails its checksum and is discarded
+    delete m;
+    boost::filesystem::directory_iterator it("archive");
+    for (; it != boost::filesystem::directory_iterator(); ++it) {
+        fstream f(it->path().string(), ios::in | ios::out | ios::binary);
+        f.seekp(-1, ios::end);
+        f.put(~f.peek());
+    }
+    m = new marker_cache(dur, lifespan, test_fprate, test_size * num_filters);
+    size_t hits = 0;
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != test_set_one.cend(); ++i)
+        if (lookup_from_all(i->first, i->second)) ++hits;
+    BOOST_CHECK_LT(hits, test_size / 100);
+}
+
+BOOST_AUTO_TEST_CASE(CompressedArchives) {
+    size_t num_filters = ceil((double)lifespan / (double)dur) + 1;
+    marker_cache::options opts;
+    opts.compress_archives = true;
+
+    // A filter sealed at a hundredth of its design load is archived in a
+    // fraction of its words, a full one is archived as it is
+    delete m;
+    boost::filesystem::remove_all("archive");
+    m = new marker_cache(dur, lifespan, test_fprate, test_size * num_filters,
+                         opts);
+    vector<pair<char*, int>>::const_iterator sparse_end =
+        test_set_one.cbegin() + test_size / 100;
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != sparse_end; ++i)
+        BOOST_CHECK_NO_THROW(m->insert(i->first, i->second));
+    m->maybe_age(true);
+    for (vector<pair<char*, int>>::const_iterator i = test_set_two.cbegin();
+         i != test_set_two.cend(); ++i)
+        BOOST_CHECK_NO_THROW(m->insert(i->first, i->second));
+    m->maybe_age(true);
+    m->flush();
+
+    vector<uintmax_t> sizes;
+    boost::filesystem::directory_iterator it("archive");
+    for (; it != boost::filesystem::directory_iterator(); ++it)
+        sizes.push_back(boost::filesystem::file_size(it->path()));
+    sort(sizes.begin(), sizes.end());
+    BOOST_REQUIRE_EQUAL(sizes.size(), num_filters - 1);
+    BOOST_CHECK_LT(sizes[num_filters - 3], sizes[num_filters - 2] / 10);
+
+    // Both are loaded back from disk
+    delete m;
+    m = new marker_cache(dur, lifespan, test_fprate, test_size * num_filters,
+                         opts);
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != sparse_end; ++i)
+        BOOST_CHECK_MESSAGE(lookup_from_all(i->first, i->second),
+                            "False Negative - fatal error");
+    for (vector<pair<char*, int>>::const_iterator i = test_set_two.cbegin();
+         i != test_set_two.cend(); ++i)
+        BOOST_CHECK_MESSAGE(lookup_from_all(i->first, i->second),
+                            "False Negative - fatal error");
+
+    // A corrupted compressed archive is discarded
+    delete m;
+    for (it = boost::filesystem::directory_iterator("archive");
+         it != boost::filesystem::directory_iterator(); ++it) {
+        fstream f(it->path().string(), ios::in | ios::out | ios::binary);
+        f.seekp(-1, ios::end);
+        f.put(~f.peek());
+    }
+    m = new marker_cache(dur, lifespan, test_fprate, test_size * num_filters,
+                         opts);
+    size_t hits = 0;
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != sparse_end; ++i)
+        if (lookup_from_all(i->first, i->second)) ++hits;
+    BOOST_CHECK_LT(hits, test_size / 1000);
+}
+
+BOOST_AUTO_TEST_CASE(LazyLoading) {
+    size_t num_filters = ceil((double)lifespan / (double)dur) + 1;
+    marker_cache::options opts;
+    opts.lazy_load = true;
+
+    // Archive one filter per set, the first one ends up the oldest
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != test_set_one.cend(); ++i)
+        BOOST_CHECK_NO_THROW(m->insert(i->first, i->second));
+    m->maybe_age(true);
+    for (vector<pair<char*, int>>::const_iterator i = test_set_two.cbegin();
+         i != test_set_two.cend(); ++i)
+        BOOST_CHECK_NO_THROW(m->insert(i->first, i->second));
+    m->maybe_age(true);
+    delete m;
+
+    // Filters answer maybe while loading, never a false negative
+    m = new marker_cache(dur, lifespan, test_fprate, test_size * num_filters,
+                         opts);
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != test_set_one.cend(); ++i)
+        BOOST_CHECK(lookup_from_all(i->first, i->second));
+    m->wait_loaded();
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != test_set_one.cend(); ++i)
+        BOOST_CHECK(lookup_from_all(i->first, i->second));
+    for (vector<pair<char*, int>>::const_iterator i = test_set_two.cbegin();
+         i != test_set_two.cend(); ++i)
+        BOOST_CHECK(lookup_from_all(i->first, i->second));
+
+    // Once loaded, markers never inserted are rejected again
+    vector<pair<char*, int>> absent = generate_test_data(test_size, 50, 250);
+    size_t falsepos = 0;
+    for (vector<pair<char*, int>>::const_iterator i = absent.cbegin();
+         i != absent.cend(); ++i) {
+        if (lookup_from_all(i->first, i->second)) ++falsepos;
+        delete[] i->first;
+    }
+    BOOST_CHECK_LT(falsepos, test_size / 100);
+}
+
+BOOST_AUTO_TEST_CASE(LazyLoadingAfterDowntime) {
+    size_t short_dur = 1;
+    size_t short_lifespan = 10;
+    size_t num_filters = short_lifespan / short_dur + 1;
+    size_t num_archived = num_filters - 1;
+    marker_cache::options opts;
+    opts.lazy_load = true;
+
+    // Archive half minute filters, as if the owner aged twice as often, the
+    // last of them ending minutes ago as if the cache had been down since.
+    // Together with the missed minutes they outnumber the slots.
+    delete m;
+    m = NULL;
+    boost::filesystem::remove_all("archive");
+    boost::filesystem::create_directories("archive");
+    time_t now = time(NULL);
+    size_t m_bits = 1 << 20;
+    size_t step = test_size / num_archived;
+    vector<bf::block_t> words(bf::shm_bloom_filter::num_words(m_bits, false));
+    for (size_t j = 0; j < num_archived; ++j) {
+        time_t start = now - 60 * short_lifespan + 30 * j;
+        std::fill(words.begin(), words.end(), 0);
+        bf::shm_bloom_filter filter(&words[0], m_bits, 7);
+        for (size_t i = j * step; i < (j + 1) * step; ++i)
+            filter.insert(bf::shm_bloom_filter::hash(test_set_one[i].first,
+                                                     test_set_one[i].second));
+        bf::write_archive("archive/" + to_string(start) + ".filter", start,
+                          start + 29, filter);
+    }
+
+    // The missed minutes are rebuilt and aged while the archives are still
+    // loading, without overflowing the ring. As with eager loading the
+    // ageing cycle drops the oldest filter.
+    m = new marker_cache(short_dur, short_lifespan, test_fprate,
+                         test_size * num_filters, opts);
+    m->wait_loaded();
+    for (size_t i = step; i < num_archived * step; ++i)
+        BOOST_CHECK(lookup_from_all(test_set_one[i].first,
+                                    test_set_one[i].second));
+    for (size_t j = 0; j < num_filters; ++j)
+        BOOST_CHECK_NO_THROW(m->maybe_age(true));
+}
+
+BOOST_AUTO_TEST_CASE(BackgroundPersistence) {
+    size_t num_filters = ceil((double)lifespan / (double)dur) + 1;
+
+    // Every sealed filter is on disk once the writes are flushed, and
+    // outdated filters have been removed again
+    for (size_t i = 0; i < num_filters + 1; ++i) {
+        m->maybe_age(true);
+        m->flush();
+        size_t archived = 0;
+        boost::filesystem::directory_iterator it("archive");
+        for (; it != boost::filesystem::directory_iterator(); ++it)
+            if (it->path().extension() == ".filter") ++archived;
+        BOOST_CHECK_EQUAL(archived, num_filters - 1);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(CheckpointRecovery) {
+    size_t num_filters = ceil((double)lifespan / (double)dur) + 1;
+    marker_cache::options opts;
+    opts.checkpoint_interval = 1;
+
+    delete m;
+    m = new marker_cache(dur, lifespan, test_fprate, test_size * num_filters,
+                         opts);
+    // The first set is in the first checkpoint, the second only in the
+    // chunks appended to it
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != test_set_one.cend(); ++i)
+        BOOST_CHECK_NO_THROW(m->insert(i->first, i->second));
+    this_thread::sleep_for(chrono::milliseconds(1500));
+    for (vector<pair<char*, int>>::const_iterator i = test_set_two.cbegin();
+         i != test_set_two.cend(); ++i)
+        BOOST_CHECK_NO_THROW(m->insert(i->first, i->second));
+    this_thread::sleep_for(chrono::milliseconds(1500));
+
+    // Keep the checkpoints as a crash would have left them, a clean shutdown
+    // writes a final one
+    boost::filesystem::directory_iterator it("archive");
+    vector<boost::filesystem::path> checkpoints;
+    for (; it != boost::filesystem::directory_iterator(); ++it)
+        if (it->path().extension() == ".checkpoint")
+            checkpoints.push_back(it->path());
+    BOOST_REQUIRE_EQUAL(checkpoints.size(), 1);
+    boost::filesystem::remove("crashed.checkpoint");
+    boost::filesystem::copy_file(checkpoints[0], "crashed.checkpoint");
+    delete m;
+    boost::filesystem::rename("crashed.checkpoint", checkpoints[0]);
+
+    m = new marker_cache(dur, lifespan, test_fprate, test_size * num_filters,
+                         opts);
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != test_set_one.cend(); ++i)
+        BOOST_CHECK(lookup_from_current(i->first, i->second));
+    for (vector<pair<char*, int>>::const_iterator i = test_set_two.cbegin();
+         i != test_set_two.cend(); ++i)
+        BOOST_CHECK(lookup_from_current(i->first, i->second));
+}
+
+BOOST_AUTO_TEST_CASE(MultiRangeLookups) {
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != test_set_one.cend(); ++i)
+        BOOST_CHECK_NO_THROW(m->insert(i->first, i->second));
+    m->maybe_age(true);
+
+    time_t now = time(NULL);
+    time_t max = (std::numeric_limits<time_t>::max)();
+    marker_cache::timerange ranges[] = {
+        marker_cache::timerange(0, 100), marker_cache::timerange(0, max),
+        marker_cache::timerange(now - 3600, now + 3600),
+        marker_cache::timerange(max, max), marker_cache::timerange(max, 0)};
+    size_t num_ranges = sizeof(ranges) / sizeof(ranges[0]);
+
+    // Every range answers as its own lookup would, whether the marker is
+    // given by its bytes or by its hash
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != test_set_one.cbegin() + 1000; ++i) {
+        hash128_t h = bf::shm_bloom_filter::hash(i->first, i->second);
+        boost::dynamic_bitset<> found =
+            m->lookup_from(ranges, num_ranges, i->first, i->second);
+        BOOST_CHECK(found == m->lookup_from(ranges, num_ranges, h));
+        for (size_t r = 0; r < num_ranges; ++r) {
+            BOOST_CHECK_EQUAL(found[r],
+                              m->lookup_from(ranges[r].first, ranges[r].second,
+                                             i->first, i->second));
+            BOOST_CHECK_EQUAL(found[r], m->lookup_from(ranges[r].first,
+                                                       ranges[r].second, h));
+        }
+        BOOST_CHECK(!found[0] && found[1] && found[2] && !found[4]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(MatchingTimeranges) {
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != test_set_one.cend(); ++i)
+        BOOST_CHECK_NO_THROW(m->insert(i->first, i->second));
+    m->maybe_age(true);
+    for (vector<pair<char*, int>>::const_iterator i = test_set_two.cbegin();
+         i != test_set_two.cend(); ++i)
+        BOOST_CHECK_NO_THROW(m->insert(i->first, i->second));
+
+    // Each set is in exactly one filter, the sealed one ends before the
+    // current one starts
+    time_t max = (std::numeric_limits<time_t>::max)();
+    size_t extra = 0;
+    for (size_t j = 0; j < test_size; ++j) {
+        vector<marker_cache::timerange> one = m->lookup_ranges(
+            0, max, test_set_one[j].first, test_set_one[j].second);
+        vector<marker_cache::timerange> two = m->lookup_ranges(
+            0, max, test_set_two[j].first, test_set_two[j].second);
+        BOOST_REQUIRE(!one.empty() && !two.empty());
+        if (one.size() > 1 || two.size() > 1) ++extra;
+        BOOST_CHECK_LT(one.front().second, two.back().first);
+        BOOST_CHECK_EQUAL(two.back().second, max);
+    }
+    BOOST_CHECK_LT(extra, test_size / 100);
+
+    // Ranges are clipped to the search period
+    time_t now = time(NULL);
+    vector<marker_cache::timerange> clipped = m->lookup_ranges(
+        now - 10, now + 10, test_set_two[0].first, test_set_two[0].second);
+    BOOST_REQUIRE(!clipped.empty());
+    BOOST_CHECK_GE(clipped.front().first, now - 10);
+    BOOST_CHECK_EQUAL(clipped.back().second, now + 10);
+}
+
+BOOST_AUTO_TEST_CASE(NamedCaches) {
+    size_t num_filters = ceil((double)lifespan / (double)dur) + 1;
+    time_t max = (std::numeric_limits<time_t>::max)();
+    vector<string> names;
+    names.push_back("alpha");
+    names.push_back("beta");
+
+    // Independently sized caches, one per marker type
+    marker_cache::options opts;
+    opts.name = names[0];
+    marker_cache alpha(dur, lifespan, test_fprate, test_size * num_filters,
+                       opts);
+    opts.name = names[1];
+    marker_cache beta(dur, lifespan, test_fprate / 10,
+                      test_size * num_filters, opts);
+    for (size_t j = 0; j < test_size; ++j) {
+        alpha.insert(test_set_one[j].first, test_set_one[j].second);
+        beta.insert(test_set_two[j].first, test_set_two[j].second);
+    }
+
+    cache_router router(names);
+    size_t falsepos = 0;
+    for (size_t j = 0; j < test_size; ++j) {
+        BOOST_CHECK(router["alpha"].lookup_from(0, max, test_set_one[j].first,
+                                                test_set_one[j].second));
+        BOOST_CHECK(router["beta"].lookup_from(0, max, test_set_two[j].first,
+                                               test_set_two[j].second));
+        if (router["alpha"].lookup_from(0, max, test_set_two[j].first,
+                                        test_set_two[j].second))
+            ++falsepos;
+    }
+    BOOST_CHECK_LT(falsepos, test_size / 100);
+    BOOST_CHECK_THROW(router["gamma"], std::out_of_range);
+}
+
+BOOST_AUTO_TEST_CASE(ShardedCaches) {
+    size_t num_filters = ceil((double)lifespan / (double)dur) + 1;
+    time_t max = (std::numeric_limits<time_t>::max)();
+    vector<string> names;
+    names.push_back("shard0");
+    names.push_back("shard1");
+
+    // Owners split the markers by hash, the router finds them again
+    marker_cache::options opts;
+    opts.name = names[0];
+    marker_cache shard0(dur, lifespan, test_fprate,
+                        test_size * num_filters / 2, opts);
+    opts.name = names[1];
+    marker_cache shard1(dur, lifespan, test_fprate,
+                        test_size * num_filters / 2, opts);
+    marker_cache* shards[] = {&shard0, &shard1};
+    size_t in_first = 0;
+    for (size_t j = 0; j < test_size; ++j) {
+        hash128_t h = bf::shm_bloom_filter::hash(test_set_one[j].first,
+                                                 test_set_one[j].second);
+        size_t shard = cache_router::shard_of(h, 2);
+        if (shard == 0) ++in_first;
+        shards[shard]->insert(test_set_one[j].first, test_set_one[j].second);
+    }
+    BOOST_CHECK_CLOSE((double)in_first, test_size / 2.0, 2);
+
+    cache_router router(names);
+    for (size_t j = 0; j < test_size; ++j)
+        BOOST_CHECK(router.lookup_from(0, max, test_set_one[j].first,
+                                       test_set_one[j].second));
+}
+
+BOOST_AUTO_TEST_CASE(ShardedCachesOtherHash) {
+    size_t num_filters = ceil((double)lifespan / (double)dur) + 1;
+    time_t max = (std::numeric_limits<time_t>::max)();
+    vector<string> names;
+    names.push_back("shard0");
+    names.push_back("shard1");
+
+    // Shards built with another hash function are still split by
+    // MurmurHash3, their filters are probed with their own hash
+    marker_cache::options opts;
+    opts.hash = bf::hash_mum;
+    opts.name = names[0];
+    marker_cache shard0(dur, lifespan, test_fprate,
+                        test_size * num_filters / 2, opts);
+    opts.name = names[1];
+    marker_cache shard1(dur, lifespan, test_fprate,
+                        test_size * num_filters / 2, opts);
+    marker_cache* shards[] = {&shard0, &shard1};
+    for (size_t j = 0; j < test_size; ++j)
+        shards[cache_router::shard_of(test_set_one[j].first,
+                                      test_set_one[j].second, 2)]
+            ->insert(test_set_one[j].first, test_set_one[j].second);
+
+    cache_router router(names);
+    for (size_t j = 0; j < test_size; ++j)
+        BOOST_CHECK(router.lookup_from(0, max, test_set_one[j].first,
+                                       test_set_one[j].second));
+    size_t falsepos = 0;
+    for (size_t j = 0; j < test_size; ++j)
+        if (router.lookup_from(0, max, test_set_two[j].first,
+                               test_set_two[j].second))
+            ++falsepos;
+    BOOST_CHECK_LT(falsepos, test_size / 100);
+}
+
+BOOST_AUTO_TEST_CASE(MemoryUsage) {
+    size_t num_filters = ceil((double)lifespan / (double)dur) + 1;
+    marker_cache::options opts;
+    opts.huge_pages = true;
+
+    // Huge pages are used where the host has them, the segment is sized
+    // for its filters either way
+    delete m;
+    boost::filesystem::remove_all("archive");
+    m = new marker_cache(dur, lifespan, test_fprate, test_size * num_filters,
+                         opts);
+    marker_cache::memory_usage usage = m->memory();
+    BOOST_TEST_MESSAGE("Allocated " << usage.allocated << " bytes, used "
+                                    << usage.used << ", free " << usage.free
+                                    << ", page slack " << usage.page_slack
+                                    << ", huge pages " << usage.huge_pages);
+    BOOST_CHECK_EQUAL(usage.used + usage.free + usage.page_slack,
+                      usage.allocated);
+    if (!usage.huge_pages) BOOST_CHECK_EQUAL(usage.page_slack, 0u);
+    BOOST_CHECK_LT(usage.free, (usage.allocated - usage.page_slack) / 100);
+    BOOST_CHECK_LE(usage.slab, usage.used);
+    BOOST_CHECK_LT(usage.slab_free, usage.slab / num_filters);
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != test_set_one.cend(); ++i)
+        BOOST_CHECK_NO_THROW(m->insert(i->first, i->second));
+    for (size_t j = 0; j < num_filters; ++j)
+        BOOST_CHECK_NO_THROW(m->maybe_age(true));
+    BOOST_CHECK_EQUAL(m->memory().used, usage.used);
+}
+
+BOOST_AUTO_TEST_CASE(Statistics) {
+    size_t num_filters = ceil((double)lifespan / (double)dur) + 1;
+    marker_cache::options opts;
+    opts.stats = true;
+
+    delete m;
+    boost::filesystem::remove_all("archive");
+    m = new marker_cache(dur, lifespan, test_fprate, test_size * num_filters,
+                         opts);
+    for (vector<pair<char*, int>>::const_iterator i = test_set_one.cbegin();
+         i != test_set_one.cend(); ++i)
+        m->insert(i->first, i->second);
+    for (size_t j = 0; j < 1000; ++j)
+        BOOST_CHECK(m->lookup_from(0, (std::numeric_limits<time_t>::max)(),
+                                   test_set_one[j].first,
+                                   test_set_one[j].second));
+    m->maybe_age(true);
+    m->flush();
+
+    marker_cache::statistics s;
+    BOOST_REQUIRE(m->stats(s));
+    BOOST_CHECK_EQUAL(s.inserts, test_set_one.size());
+    BOOST_CHECK_EQUAL(s.lookups, 1000);
+    BOOST_CHECK_EQUAL(s.hits, 1000);
+    BOOST_CHECK_GE(s.filters_probed, s.lookups);
+    BOOST_CHECK_EQUAL(s.ageing_cycles, 1);
+    BOOST_CHECK_GE(s.saves, 1);
+    uint64_t samples = 0, inserts = 0, ageing = 0;
+    for (size_t b = 0; b < marker_cache::num_latency_buckets; ++b) {
+        samples += s.lookup_latency[b];
+        inserts += s.insert_latency[b];
+        ageing += s.age_latency[b];
+    }
+    BOOST_CHECK_EQUAL(samples, s.lookups);
+    BOOST_CHECK_EQUAL(inserts, s.inserts);
+    BOOST_CHECK_EQUAL(ageing, s.ageing_cycles);
+
+    // The filter sealed by the cycle holds its design load
+    vector<marker_cache::filter_statistics> filters = m->filter_stats();
+    BOOST_REQUIRE_GE(filters.size(), 2);
+    const marker_cache::filter_statistics& full = filters[filters.size() - 2];
+    BOOST_TEST_MESSAGE("Sealed filter fill " << full.fill << ", fp rate "
+                                             << full.fp_rate);
+    BOOST_CHECK_GT(full.fill, 0.3);
+    BOOST_CHECK_LT(full.fill, 0.7);
+    BOOST_CHECK_LT(full.fp_rate, 2 * test_fprate);
+    BOOST_CHECK_GT(full.fp_rate, test_fprate / 4);
+    BOOST_CHECK_EQUAL(filters.back().set_bits, 0);
+
+    // Readers count into the same block
+    marker_cache reader("");
+    BOOST_CHECK(reader.lookup_from(0, (std::numeric_limits<time_t>::max)(),
+                                   test_set_one[0].first,
+                                   test_set_one[0].second));
+    marker_cache::statistics after;
+    BOOST_REQUIRE(reader.stats(after));
+    BOOST_CHECK_EQUAL(after.lookups, s.lookups + 1);
+    BOOST_CHECK_EQUAL(reader.filter_stats().size(), filters.size());
+}
+
+BOOST_AUTO_TEST_CASE(StatisticsBatches) {
+    size_t num_filters = ceil((double)lifespan / (double)dur) + 1;
+    marker_cache::options opts;
+    opts.stats = true;
+
+    delete m;
+    boost::filesystem::remove_all("archive");
+    m = new marker_cache(dur, lifespan, test_fprate, test_size * num_filters,
+                         opts);
+    vector<marker_cache::marker> markers(test_set_one.cbegin(),
+                                         test_set_one.cend());
+    size_t batch = 1000;
+    size_t num_batches = markers.size() / batch;
+    for (size_t j = 0; j < num_batches; ++j)
+        m->insert_batch(&markers[j * batch], batch);
+    m->insert(markers[0].first, markers[0].second);
+    BOOST_CHECK(
+        m->lookup_from_batch(0, (std::numeric_limits<time_t>::max)(),
+                             &markers[0], batch)
+            .all());
+
+    // Counters count markers, histograms count calls
+    marker_cache::statistics s;
+    BOOST_REQUIRE(m->stats(s));
+    BOOST_CHECK_EQUAL(s.inserts, num_batches * batch + 1);
+    BOOST_CHECK_EQUAL(s.lookups, batch);
+    BOOST_CHECK_EQUAL(s.hits, batch);
+    uint64_t samples = 0, inserts = 0;
+    for (size_t b = 0; b < marker_cache::num_latency_buckets; ++b) {
+        samples += s.lookup_latency[b];
+        inserts += s.insert_latency[b];
+    }
+    BOOST_CHECK_EQUAL(samples, 1);
+    BOOST_CHECK_EQUAL(inserts, num_batches + 1);
+}
+
 BOOST_AUTO_TEST_CASE(SufficientMemoryAllocated) {
     size_t num_filters = ceil((double)lifespan / (double)dur) + 1;
     for (int i = 0; i <= 2 * num_filters; ++i) {
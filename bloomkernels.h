@@ -0,0 +1,128 @@
+#ifndef BF_BLOOM_KERNELS_H
+#define BF_BLOOM_KERNELS_H
+
+#include <shmbloomfilter.h>
+
+// Probe loops of shm_bloom_filter, specialised on the number of hash
+// functions, the word type and the reduction of hashes onto the filter.
+// With K fixed the loops are fully unrolled, K = 0 takes k at runtime.
+namespace bf {
+
+struct modulo_reduce {
+    static size_t reduce(uint64_t x, size_t n) { return x % n; }
+};
+
+// n must be a power of two
+struct mask_reduce {
+    static size_t reduce(uint64_t x, size_t n) { return x & (n - 1); }
+};
+
+// Lemire's multiply-shift, maps x onto [0, n) with the high word of x * n
+struct multiply_shift_reduce {
+    static size_t reduce(uint64_t x, size_t n) {
+        return (size_t)(((unsigned __int128)x * n) >> 64);
+    }
+};
+
+template <class Block>
+inline void set_bit(Block* bits, size_t word, Block mask, bool concurrent,
+                    dirty_t* dirty) {
+    // Skip the store, or the locked instruction, when the bit is already set
+    if (__atomic_load_n(bits + word, __ATOMIC_RELAXED) & mask) return;
+    if (!concurrent)
+        bits[word] |= mask;
+    else
+        __atomic_fetch_or(bits + word, mask, __ATOMIC_RELAXED);
+    // Published after the bit so a checkpoint clearing the flag sees it
+    if (dirty) dirty[word / chunk_words].store(1, std::memory_order_release);
+}
+
+// Bits scattered over the whole filter by double hashing, h1 + i * h2
+template <int K, class Block, class Reduce>
+struct classic_kernel {
+    static const size_t bits_per_block = 8 * sizeof(Block);
+
+    static bool lookup(const Block* bits, size_t num_bits, int k,
+                       hash128_t hash) {
+        for (int i = 0; i < (K ? K : k); ++i) {
+            size_t bit = Reduce::reduce(hash.h1 + i * hash.h2, num_bits);
+            if (!(bits[bit / bits_per_block] &
+                  (Block(1) << (bit % bits_per_block))))
+                return false;
+        }
+        return true;
+    }
+
+    static void insert(Block* bits, size_t num_bits, int k, hash128_t hash,
+                       bool concurrent, dirty_t* dirty) {
+        for (int i = 0; i < (K ? K : k); ++i) {
+            size_t bit = Reduce::reduce(hash.h1 + i * hash.h2, num_bits);
+            set_bit(bits, bit / bits_per_block,
+                    Block(1) << (bit % bits_per_block), concurrent, dirty);
+        }
+    }
+
+    static void prefetch(const Block* bits, size_t num_bits, int k,
+                         hash128_t hash) {
+        for (int i = 0; i < (K ? K : k); ++i)
+            __builtin_prefetch(
+                bits +
+                Reduce::reduce(hash.h1 + i * hash.h2, num_bits) /
+                    bits_per_block);
+    }
+};
+
+// All bits of a key within one cache line picked by h1, the positions inside
+// it are the top bits of h2 remixed with an odd multiplier between probes
+template <int K, class Block, class Reduce>
+struct blocked_kernel {
+    static const size_t bits_per_block = 8 * sizeof(Block);
+    static const size_t blocks_per_line = cache_line_bits / bits_per_block;
+
+    static size_t line(size_t num_bits, hash128_t hash) {
+        return Reduce::reduce(hash.h1, num_bits / cache_line_bits) *
+               blocks_per_line;
+    }
+
+    static size_t line_bit(uint64_t& x) {
+        size_t bit = x >> (64 - 9);
+        x *= 0x9e3779b97f4a7c15ULL;
+        return bit;
+    }
+
+    // The line is already in cache after the first probe, test every bit
+    // without branching
+    static bool lookup(const Block* bits, size_t num_bits, int k,
+                       hash128_t hash) {
+        const Block* l = bits + line(num_bits, hash);
+        uint64_t x = hash.h2;
+        Block missing = 0;
+        for (int i = 0; i < (K ? K : k); ++i) {
+            size_t bit = line_bit(x);
+            missing |= ~l[bit / bits_per_block] &
+                       (Block(1) << (bit % bits_per_block));
+        }
+        return !missing;
+    }
+
+    static void insert(Block* bits, size_t num_bits, int k, hash128_t hash,
+                       bool concurrent, dirty_t* dirty) {
+        size_t first = line(num_bits, hash);
+        uint64_t x = hash.h2;
+        for (int i = 0; i < (K ? K : k); ++i) {
+            size_t bit = line_bit(x);
+            set_bit(bits, first + bit / bits_per_block,
+                    Block(1) << (bit % bits_per_block), concurrent, dirty);
+        }
+    }
+
+    // A marker's bits all lie in one cache line, whatever k is
+    static void prefetch(const Block* bits, size_t num_bits, int /*k*/,
+                         hash128_t hash) {
+        __builtin_prefetch(bits + line(num_bits, hash));
+    }
+};
+
+}  // namespace bf
+
+#endif
@@ -0,0 +1,45 @@
+#include <cacherouter.h>
+
+cache_router::cache_router(const std::vector<std::string>& names) {
+    try {
+        for (size_t i = 0; i < names.size(); ++i) {
+            caches_.push_back(new marker_cache(names[i]));
+            index_[names[i]] = i;
+        }
+    } catch (...) {
+        for (size_t i = 0; i < caches_.size(); ++i) delete caches_[i];
+        throw;
+    }
+}
+
+cache_router::~cache_router() {
+    for (size_t i = 0; i < caches_.size(); ++i) delete caches_[i];
+}
+
+const marker_cache& cache_router::operator[](const std::string& name) const {
+    return *caches_[index_.at(name)];
+}
+
+size_t cache_router::shard_of(hash128_t hash, size_t num_shards) {
+    // The filters reduce h1 + i * h2 onto their bits, shard on a remix of
+    // both halves so every shard still covers its filters uniformly
+    uint64_t x = hash.h1 ^ (hash.h2 >> 32 | hash.h2 << 32);
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return (size_t)(((unsigned __int128)x * num_shards) >> 64);
+}
+
+size_t cache_router::shard_of(const void* data, int data_len,
+                              size_t num_shards) {
+    return shard_of(bf::shm_bloom_filter::hash(data, data_len), num_shards);
+}
+
+bool cache_router::lookup_from(time_t start, time_t end, const void* data,
+                               int data_len) const {
+    // The hash picking the shard is the one filters built with MurmurHash3
+    // are probed with
+    hash128_t h = bf::shm_bloom_filter::hash(data, data_len);
+    return caches_[shard_of(h, caches_.size())]->lookup_from(
+        start, end, data, data_len, h, bf::hash_murmur3);
+}
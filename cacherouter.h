@@ -0,0 +1,43 @@
+#ifndef CACHE_ROUTER_H
+#define CACHE_ROUTER_H
+#include <markercache.h>
+#include <map>
+#include <string>
+#include <vector>
+
+// Reader handle over several named caches on the host, either one per marker
+// type or shards of one marker space split by hash
+class cache_router {
+   public:
+    // Attach to every cache in names as a reader, throws if one is missing
+    explicit cache_router(const std::vector<std::string> &names);
+    ~cache_router();
+
+    // Forbid copy construction
+    cache_router(cache_router const &) = delete;
+    cache_router &operator=(cache_router const &) = delete;
+
+    // Cache holding a given marker type
+    // Throws std::out_of_range for a name the router was not given
+    const marker_cache &operator[](const std::string &name) const;
+
+    // Shard of num_shards a marker hashed with MurmurHash3 belongs to,
+    // whatever hash function the filters of the shards are built with
+    static size_t shard_of(hash128_t hash, size_t num_shards);
+    // Shard of num_shards a marker belongs to, the owners insert each marker
+    // into the cache of its shard so that lookup_from finds it
+    static size_t shard_of(const void *data, int data_len, size_t num_shards);
+
+    // Look up a marker in the shard it belongs to, the caches are taken as
+    // shards in the order their names were given. The hash picking the shard
+    // is reused by the filters built with MurmurHash3, the others hash the
+    // marker with their own function.
+    bool lookup_from(time_t start, time_t end, const void *data,
+                     int data_len) const;
+
+   private:
+    std::vector<marker_cache *> caches_;
+    std::map<std::string, size_t> index_;
+};
+
+#endif
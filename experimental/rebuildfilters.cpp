@@ -68,12 +68,19 @@ int main() {
             ("Found %d markers in the %s subtables", mtuple_count, i->c_str()));
       }
 
+      std::vector<marker_cache::marker> markers;
       for (int k = 0; k < PQntuples(mres); ++k) {
+        // Markers are read from the subtable rows in mres, res only holds
+        // the table IDs
         // TODO: Need the correct offset for each value
         // Each marker type has a different offset
         int offset = 0;
-        db_marker_cache->insert(PQgetvalue(res, k, offset));
+        markers.push_back(marker_cache::marker(PQgetvalue(mres, k, offset),
+                                               PQgetlength(mres, k, offset)));
       }
+      // Insert the whole result set at once
+      if (!markers.empty())
+        db_marker_cache->insert_batch(&markers[0], markers.size());
 
       PQclear(mres);
     }
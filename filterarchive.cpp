@@ -0,0 +1,405 @@
+#include <filterarchive.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+namespace bf {
+
+// MurmurHash3 takes an int length, hash large filters a chunk at a time
+static const size_t checksum_chunk = 1 << 30;
+// Words a compressed archive is read in at a time
+static const size_t read_words = 8192;
+
+namespace {
+
+// Bits packed into words from the least significant end
+class bit_writer {
+   public:
+    bit_writer() : acc_(0), used_(0) {}
+
+    // value must fit in bits, at most 64
+    void put(uint64_t value, unsigned bits) {
+        if (!bits) return;
+        acc_ |= value << used_;
+        if (used_ + bits < 64) {
+            used_ += bits;
+            return;
+        }
+        words_.push_back(acc_);
+        acc_ = used_ ? value >> (64 - used_) : 0;
+        used_ = used_ + bits - 64;
+    }
+
+    // q zero bits then a one
+    void put_unary(uint64_t q) {
+        for (; q >= 63; q -= 63) put(0, 63);
+        put(uint64_t(1) << q, q + 1);
+    }
+
+    std::vector<uint64_t> finish() {
+        if (used_) words_.push_back(acc_);
+        acc_ = 0;
+        used_ = 0;
+        std::vector<uint64_t> words;
+        words.swap(words_);
+        return words;
+    }
+
+   private:
+    std::vector<uint64_t> words_;
+    uint64_t acc_;
+    unsigned used_;
+};
+
+// Reads back what bit_writer wrote, a buffer of words at a time
+class bit_reader {
+   public:
+    explicit bit_reader(std::istream& is)
+        : is_(is), buf_(read_words), pos_(0), end_(0), cur_(0), left_(0) {}
+
+    uint64_t get(unsigned bits) {
+        if (!bits) return 0;
+        uint64_t value = cur_;
+        if (bits > left_) {
+            unsigned got = left_;
+            load();
+            value |= cur_ << got;
+            bits -= got;
+            skip(bits);
+            return value & mask(got + bits);
+        }
+        skip(bits);
+        return value & mask(bits);
+    }
+
+    uint64_t get_unary() {
+        uint64_t q = 0;
+        while (!cur_) {
+            q += left_;
+            load();
+        }
+        unsigned z = __builtin_ctzll(cur_);
+        skip(z + 1);
+        return q + z;
+    }
+
+    // True if only the zero bits padding the last word are left
+    bool at_end() {
+        return !cur_ && pos_ == end_ &&
+               is_.peek() == std::char_traits<char>::eof();
+    }
+
+   private:
+    static uint64_t mask(unsigned bits) {
+        return bits < 64 ? (uint64_t(1) << bits) - 1 : ~uint64_t(0);
+    }
+
+    void skip(unsigned bits) {
+        cur_ = bits < 64 ? cur_ >> bits : 0;
+        left_ -= bits;
+    }
+
+    void load() {
+        if (pos_ == end_) {
+            is_.read(reinterpret_cast<char*>(&buf_[0]),
+                     buf_.size() * sizeof(uint64_t));
+            std::streamsize n = is_.gcount();
+            if (n == 0 || n % sizeof(uint64_t))
+                throw std::runtime_error("Truncated archive");
+            end_ = n / sizeof(uint64_t);
+            pos_ = 0;
+            is_.clear();
+        }
+        cur_ = buf_[pos_++];
+        left_ = 64;
+    }
+
+    std::istream& is_;
+    std::vector<uint64_t> buf_;
+    size_t pos_;
+    size_t end_;
+    uint64_t cur_;
+    unsigned left_;
+};
+
+}  // namespace
+
+// Rice parameter for the gaps between set bits at a density of ones in bits,
+// gaps are geometric and about log2(ln2 / density) is optimal
+// Rice - Some practical universal noiseless coding techniques, 1979
+static unsigned rice_parameter(size_t ones, size_t bits) {
+    // An empty filter is only its count
+    if (!ones) return 62;
+    double r = std::log2(std::log(2.0) * bits / ones);
+    return r < 1 ? 0 : (unsigned)std::min(62.0, std::floor(r));
+}
+
+// Set bits of the words as a count, the Rice parameter and the Rice coded
+// gaps between them
+static std::vector<uint64_t> encode(const block_t* words, size_t num_words,
+                                    unsigned r) {
+    bit_writer out;
+    out.put(0, 64);
+    out.put(r, 64);
+    uint64_t ones = 0;
+    uint64_t next = 0;
+    for (size_t i = 0; i < num_words; ++i) {
+        for (block_t w = words[i]; w; w &= w - 1) {
+            uint64_t bit = i * bits_per_block_t + __builtin_ctzll(w);
+            uint64_t gap = bit - next;
+            out.put_unary(gap >> r);
+            out.put(gap & ((uint64_t(1) << r) - 1), r);
+            next = bit + 1;
+            ++ones;
+        }
+    }
+    // Counted as they are coded, inserts may still be setting bits
+    std::vector<uint64_t> encoded = out.finish();
+    encoded[0] = ones;
+    return encoded;
+}
+
+static void decode(std::istream& is, block_t* words, size_t num_words) {
+    std::fill(words, words + num_words, block_t(0));
+    bit_reader in(is);
+    uint64_t ones = in.get(64);
+    unsigned r = in.get(64);
+    uint64_t num_bits = num_words * bits_per_block_t;
+    if (r > 62 || ones > num_bits)
+        throw std::runtime_error("Corrupt compressed archive");
+    uint64_t next = 0;
+    for (uint64_t j = 0; j < ones; ++j) {
+        uint64_t q = in.get_unary();
+        if (q > num_bits >> r)
+            throw std::runtime_error("Corrupt compressed archive");
+        uint64_t bit = next + (q << r | in.get(r));
+        if (bit >= num_bits)
+            throw std::runtime_error("Corrupt compressed archive");
+        words[bit / bits_per_block_t] |= block_t(1)
+                                         << (bit % bits_per_block_t);
+        next = bit + 1;
+    }
+    if (!in.at_end()) throw std::runtime_error("Corrupt compressed archive");
+}
+
+static uint64_t checksum(const archive_header& header, const block_t* bits) {
+    hash128_t h = MurmurHash3_x64_128(
+        &header, offsetof(archive_header, checksum), archive_magic);
+    // Checkpoint records carry their own hashes
+    if (!bits) return h.h1;
+    const char* data = reinterpret_cast<const char*>(bits);
+    size_t bytes = header.num_words * sizeof(block_t);
+    for (size_t done = 0; done < bytes; done += checksum_chunk)
+        h = MurmurHash3_x64_128(data + done,
+                                std::min(checksum_chunk, bytes - done),
+                                (uint32_t)h.h1);
+    return h.h1;
+}
+
+static archive_header make_header(time_t start, time_t end,
+                                  const shm_bloom_filter& filter,
+                                  uint32_t flags) {
+    archive_header header = archive_header();
+    header.magic = archive_magic;
+    header.version = flags & archive_compressed ? archive_version : 1;
+    header.start = start;
+    header.end = end;
+    header.num_bits = filter.size();
+    header.num_hashes = filter.hashes();
+    header.flags = flags | (filter.blocked() ? archive_blocked : 0) |
+                   filter.reduction() << archive_reduction_shift |
+                   filter.hash_function() << archive_hash_shift;
+    header.num_words = shm_bloom_filter::num_words(filter.size(),
+                                                   filter.blocked());
+    return header;
+}
+
+static archive_header read_header(std::istream& is, size_t max_words) {
+    archive_header header;
+    is.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!is || header.magic != archive_magic)
+        throw std::runtime_error("Not a filter archive");
+    if (header.version < 1 || header.version > archive_version ||
+        (header.version < 2 && (header.flags & archive_compressed)))
+        throw std::runtime_error("Unsupported archive version");
+    if (header.hash() >= num_hash_ids)
+        throw std::runtime_error("Unknown hash function");
+    if (header.num_words > max_words ||
+        header.num_words !=
+            shm_bloom_filter::num_words(header.num_bits,
+                                        header.flags & archive_blocked))
+        throw std::runtime_error("Archived filter does not fit");
+    return header;
+}
+
+archive_header read_header(const std::string& path, size_t max_words) {
+    std::ifstream ifs(path.c_str(), std::ios::binary);
+    return read_header(ifs, max_words);
+}
+
+// Chunks are copied out before they are hashed and written since inserts
+// may still be setting bits in them
+static size_t write_chunks(std::ostream& os, const shm_bloom_filter& filter,
+                           const std::vector<size_t>& chunks) {
+    size_t num_words =
+        shm_bloom_filter::num_words(filter.size(), filter.blocked());
+    std::vector<block_t> copy(chunk_words);
+    size_t bytes = 0;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        size_t first = chunks[i] * chunk_words;
+        size_t n = std::min(chunk_words, num_words - first);
+        std::memcpy(&copy[0], filter.data() + first, n * sizeof(block_t));
+
+        checkpoint_record record;
+        record.chunk = chunks[i];
+        record.checksum =
+            MurmurHash3_x64_128(&copy[0], n * sizeof(block_t),
+                                (uint32_t)chunks[i])
+                .h1;
+        os.write(reinterpret_cast<const char*>(&record), sizeof(record));
+        os.write(reinterpret_cast<const char*>(&copy[0]), n * sizeof(block_t));
+        bytes += sizeof(record) + n * sizeof(block_t);
+    }
+    return bytes;
+}
+
+size_t write_archive(const std::string& path, time_t start, time_t end,
+                     const shm_bloom_filter& filter, unsigned folds,
+                     bool compress) {
+    uint32_t flags = std::min(folds, 15u) << archive_folds_shift;
+    size_t num_words =
+        shm_bloom_filter::num_words(filter.size(), filter.blocked());
+
+    // Copied out once since inserts may still be setting bits, the checksum
+    // and whatever is written must come from the same words
+    std::vector<block_t> copy(num_words);
+    if (num_words)
+        std::memcpy(&copy[0], filter.data(), num_words * sizeof(block_t));
+    const block_t* words = num_words ? &copy[0] : NULL;
+
+    // Compress only if the density promises to save an eighth, Rice coding
+    // costs about r + 1 bits per set bit and a bit per 2^r clear ones
+    std::vector<uint64_t> encoded;
+    if (compress) {
+        size_t ones = 0;
+        for (size_t i = 0; i < num_words; ++i)
+            ones += __builtin_popcountll(words[i]);
+        size_t bits = num_words * bits_per_block_t;
+        unsigned r = rice_parameter(ones, bits);
+        double estimate = 128 + (double)ones * (r + 1) + ((bits - ones) >> r);
+        if (estimate < bits * 0.875) {
+            encoded = encode(words, num_words, r);
+            flags |= archive_compressed;
+        }
+    }
+
+    archive_header header = make_header(start, end, filter, flags);
+    header.checksum = checksum(header, words);
+    const char* data = reinterpret_cast<const char*>(words);
+    size_t bytes = num_words * sizeof(block_t);
+    if (flags & archive_compressed) {
+        data = reinterpret_cast<const char*>(&encoded[0]);
+        bytes = encoded.size() * sizeof(uint64_t);
+    }
+
+    // Write next to the destination and rename so that a crash never leaves
+    // a partial archive behind
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream ofs(tmp.c_str(), std::ios::binary | std::ios::trunc);
+        ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        ofs.write(data, bytes);
+        if (!ofs) throw std::runtime_error("Failed to write " + tmp);
+    }
+    if (std::rename(tmp.c_str(), path.c_str()) != 0)
+        throw std::runtime_error("Failed to rename " + tmp);
+    return sizeof(header) + bytes;
+}
+
+bool is_archive(const std::string& path) {
+    std::ifstream ifs(path.c_str(), std::ios::binary);
+    uint32_t magic = 0;
+    ifs.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+    return ifs && magic == archive_magic;
+}
+
+void write_checkpoint(const std::string& path, time_t start, time_t end,
+                      const shm_bloom_filter& filter) {
+    archive_header header =
+        make_header(start, end, filter, archive_checkpoint);
+    header.checksum = checksum(header, NULL);
+    std::vector<size_t> chunks(
+        shm_bloom_filter::num_chunks(filter.size(), filter.blocked()));
+    for (size_t c = 0; c < chunks.size(); ++c) chunks[c] = c;
+
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream ofs(tmp.c_str(), std::ios::binary | std::ios::trunc);
+        ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        write_chunks(ofs, filter, chunks);
+        if (!ofs) throw std::runtime_error("Failed to write " + tmp);
+    }
+    if (std::rename(tmp.c_str(), path.c_str()) != 0)
+        throw std::runtime_error("Failed to rename " + tmp);
+}
+
+size_t append_checkpoint(const std::string& path,
+                         const shm_bloom_filter& filter,
+                         const std::vector<size_t>& chunks) {
+    std::ofstream ofs(path.c_str(), std::ios::binary | std::ios::app);
+    size_t bytes = write_chunks(ofs, filter, chunks);
+    ofs.flush();
+    if (!ofs) throw std::runtime_error("Failed to append to " + path);
+    return bytes;
+}
+
+archive_header read_checkpoint(const std::string& path, block_t* bits,
+                               size_t max_words) {
+    std::ifstream ifs(path.c_str(), std::ios::binary);
+    archive_header header = read_header(ifs, max_words);
+    if (!(header.flags & archive_checkpoint) ||
+        checksum(header, NULL) != header.checksum)
+        throw std::runtime_error("Not a valid checkpoint");
+
+    std::fill(bits, bits + header.num_words, block_t(0));
+    size_t num_chunks = (header.num_words + chunk_words - 1) / chunk_words;
+    std::vector<block_t> copy(chunk_words);
+    checkpoint_record record;
+    while (ifs.read(reinterpret_cast<char*>(&record), sizeof(record))) {
+        if (record.chunk >= num_chunks) break;
+        size_t first = record.chunk * chunk_words;
+        size_t n = std::min(chunk_words, (size_t)header.num_words - first);
+        ifs.read(reinterpret_cast<char*>(&copy[0]), n * sizeof(block_t));
+        if (!ifs ||
+            MurmurHash3_x64_128(&copy[0], n * sizeof(block_t),
+                                (uint32_t)record.chunk)
+                    .h1 != record.checksum)
+            break;
+        std::copy(copy.begin(), copy.begin() + n, bits + first);
+    }
+    return header;
+}
+
+archive_header read_archive(const std::string& path, block_t* bits,
+                            size_t max_words) {
+    std::ifstream ifs(path.c_str(), std::ios::binary);
+    archive_header header = read_header(ifs, max_words);
+    if (header.flags & archive_checkpoint)
+        throw std::runtime_error("Archive is a checkpoint");
+
+    if (header.flags & archive_compressed) {
+        decode(ifs, bits, header.num_words);
+    } else {
+        ifs.read(reinterpret_cast<char*>(bits),
+                 header.num_words * sizeof(block_t));
+        if (!ifs) throw std::runtime_error("Truncated archive");
+    }
+    if (checksum(header, bits) != header.checksum)
+        throw std::runtime_error("Archive checksum mismatch");
+    return header;
+}
+
+}  // namespace bf
@@ -0,0 +1,110 @@
+#ifndef BF_FILTER_ARCHIVE_H
+#define BF_FILTER_ARCHIVE_H
+
+#include <shmbloomfilter.h>
+#include <ctime>
+#include <string>
+#include <vector>
+
+namespace bf {
+
+// Versioned binary format for archived filters, a fixed header followed by
+// the raw words of the filter. A filter is loaded with a single read straight
+// into its slot in shared memory.
+// Sparse filters may instead be stored as the gaps between their set bits,
+// Rice coded, and are decoded straight into their slot. Only these carry
+// version 2, version 1 archives are always raw.
+const uint32_t archive_magic = 0x544c4642;  // "BFLT"
+const uint32_t archive_version = 2;
+
+// Flags describing the layout of the archived filter
+const uint32_t archive_blocked = 1;
+// The words are not stored after the header but in checkpoint records
+const uint32_t archive_checkpoint = 2;
+// The reduction_t of the filter is kept in two bits from here, archives
+// written before it was recorded reduce with modulo
+const uint32_t archive_reduction_shift = 4;
+// The hash_id of the filter is kept in four bits from here, archives written
+// before it was recorded use MurmurHash3
+const uint32_t archive_hash_shift = 6;
+// Times the filter was folded in half, in four bits from here
+const uint32_t archive_folds_shift = 10;
+// The words are Rice coded after the header
+const uint32_t archive_compressed = 1 << 14;
+
+struct archive_header {
+    uint32_t magic;
+    uint32_t version;
+    // Timerange covered by the filter
+    int64_t start;
+    int64_t end;
+    uint64_t num_bits;
+    uint32_t num_hashes;
+    uint32_t flags;
+    uint64_t num_words;
+    // Hash of the header fields above and the words following the header
+    uint64_t checksum;
+
+    reduction_t reduction() const {
+        return (reduction_t)((flags >> archive_reduction_shift) & 3);
+    }
+    hash_id hash() const {
+        return (hash_id)((flags >> archive_hash_shift) & 15);
+    }
+    unsigned folds() const { return (flags >> archive_folds_shift) & 15; }
+};
+
+// Checkpoints of a filter still receiving inserts are a header followed by
+// records of whole chunks of its words. Bits are only ever set so a chunk
+// recorded later supersedes the earlier records of the same chunk.
+struct checkpoint_record {
+    uint64_t chunk;
+    // Hash of the chunk index and the words following the record
+    uint64_t checksum;
+};
+
+// Write the filter covering [start, end], folded folds times, to path. The
+// file only appears once it is complete.
+// With compress set the filter is Rice coded if its density of set bits
+// makes that noticeably smaller than its words. Returns the bytes written.
+size_t write_archive(const std::string& path, time_t start, time_t end,
+                     const shm_bloom_filter& filter, unsigned folds = 0,
+                     bool compress = false);
+
+// Write a checkpoint of every chunk of the filter to path, replacing any
+// earlier checkpoint once it is complete
+void write_checkpoint(const std::string& path, time_t start, time_t end,
+                      const shm_bloom_filter& filter);
+
+// Append records of the given chunks of the filter to the checkpoint at path
+// Returns the number of bytes written
+size_t append_checkpoint(const std::string& path,
+                         const shm_bloom_filter& filter,
+                         const std::vector<size_t>& chunks);
+
+// Read the checkpoint at path into bits, which can hold max_words words, and
+// return its header. A torn record at the end, left by a crash while
+// appending, is ignored.
+// Throws std::runtime_error if the file is not a valid checkpoint or its
+// filter does not fit
+archive_header read_checkpoint(const std::string& path, block_t* bits,
+                               size_t max_words);
+
+// Read only the header of the archive or checkpoint at path
+// Throws std::runtime_error if the file is not a valid archive or its filter
+// does not fit in max_words words
+archive_header read_header(const std::string& path, size_t max_words);
+
+// True if the file at path starts with the binary archive magic
+bool is_archive(const std::string& path);
+
+// Read the archive at path into bits, which can hold max_words words, and
+// return its header. Compressed archives are decoded as they are read.
+// Throws std::runtime_error if the file is not a valid archive or its filter
+// does not fit
+archive_header read_archive(const std::string& path, block_t* bits,
+                            size_t max_words);
+
+}  // namespace bf
+
+#endif
@@ -1,8 +1,125 @@
 #include <markercache.h>
+#include <sys/mman.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+#include <chrono>
+
+// Number of markers a batch probe runs ahead of the one being tested
+static const size_t prefetch_distance = 8;
+// Number of markers hashed at a time by insert_batch
+static const size_t insert_chunk = 256;
+// Bytes the segment manager adds to each allocation for its block header,
+// name and alignment, at most
+static const size_t allocation_overhead = 128;
+// Each stage chained to a filter holds this many times the markers of the
+// stage before it, at this fraction of its false positive rate
+// Almeida et al. - Scalable Bloom Filters, 2007
+static const size_t stage_growth = 2;
+static const double stage_tightening = 0.5;
+// Adaptively sized filters are designed for this many times the markers
+// expected in their period
+static const double forecast_headroom = 1.25;
+// Where the segment is created with huge pages, and the f_type statfs reports
+// for a hugetlbfs mount
+static const char* const huge_page_mount = "/dev/hugepages";
+static const long hugetlbfs_magic = 0x958458f6;
+
+// Taken by reference by std::min, so it needs a definition
+const size_t marker_cache::max_stages;
+
+// Monotonic time in nanoseconds, for the latency histograms
+static uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// Count a latency of ns nanoseconds in its histogram bucket
+static void record(std::atomic<uint64_t>* histogram, uint64_t ns) {
+    size_t b = ns ? 64 - __builtin_clzll(ns) : 0;
+    b = std::min(b, marker_cache::num_latency_buckets - 1);
+    histogram[b].fetch_add(1, std::memory_order_relaxed);
+}
+
+// Hashes h of a whole batch under the hash function id, computed the first
+// time they are needed
+static std::vector<hash128_t>& batch_hashes(std::vector<hash128_t>& h,
+                                            bf::hash_id id,
+                                            std::vector<const void*>& data,
+                                            std::vector<int>& data_len) {
+    if (h.empty()) {
+        h.resize(data.size());
+        bf::shm_bloom_filter::hash(&data[0], &data_len[0], data.size(), &h[0],
+                                   id);
+    }
+    return h;
+}
+
+// Number of chunks covering words
+static size_t chunks(size_t words) {
+    return (words + bf::chunk_words - 1) / bf::chunk_words;
+}
+
+// Largest power of two no greater than n
+static size_t floor_pow2(size_t n) {
+    return n ? size_t(1) << (63 - __builtin_clzll(n)) : 0;
+}
+
+// Bits and hash functions of a filter holding n markers at a false positive
+// rate of fp. A foldable filter has a power of two bits, or cache lines.
+static void filter_geometry(double n, double fp, bool blocked, bool foldable,
+                            size_t& m, size_t& k) {
+    double ln2 = std::log(2);
+    // Num. bits - https://en.wikipedia.org/wiki/Bloom_filter
+    // m = -(nln(p))/(ln2^2) where n = num objects, p = false pos rate
+    m = std::ceil(-((n * std::log(fp)) / ln2) / ln2);
+    // Num. hash functions
+    // k = (m/n)*ln2
+    k = std::ceil((double)m / n * ln2);
+    if (foldable) {
+        // Rounding up only lowers the false positive rate
+        size_t unit = blocked ? bf::cache_line_bits : bf::bits_per_block_t;
+        size_t units = (m + unit - 1) / unit;
+        m = (units > 1 ? floor_pow2(units - 1) * 2 : 1) * unit;
+        return;
+    }
+    if (!blocked) return;
+
+    // Blocked filters pay for their locality with a higher false positive
+    // rate, grow the filters until the target rate is met again
+    size_t capacity = std::max<size_t>(1, n);
+    m = std::ceil((double)m / bf::cache_line_bits) * bf::cache_line_bits;
+    while (bf::shm_bloom_filter::fp_rate(m, capacity, k, true) > fp)
+        m += std::max<size_t>(bf::cache_line_bits,
+                              m / 100 / bf::cache_line_bits *
+                                  bf::cache_line_bits);
+}
 
 marker_cache::marker_cache(size_t min_filterduration, size_t min_filterlifespan,
-                           double fp, size_t total_capacity)
-    : owner_(true), sec_filterduration(60 * min_filterduration) {
+                           double fp, size_t total_capacity,
+                           const options& opts)
+    : shm_(NULL),
+      hugetlb_(NULL),
+      owner_(true),
+      stats_region_(NULL),
+      stats_(NULL),
+      current_(NULL),
+      inserted_(0),
+      stage_capacity_(0),
+      roll_over_retry_(false),
+      recent_rate_(-1),
+      sec_filterduration(60 * min_filterduration),
+      persist_busy_(false),
+      persist_stop_(false),
+      checkpoint_stages_(0),
+      checkpoint_bytes_(0),
+      load_next_(0),
+      load_done_(0),
+      summary_size_(0),
+      summary_k_(0),
+      open_summary_(no_summary),
+      fp_(fp),
+      opts_(opts) {
     assert(min_filterduration > 0);
     assert(min_filterlifespan > 0);
 
@@ -14,38 +131,110 @@ marker_cache::marker_cache(size_t min_filterduration, size_t min_filterlifespan,
     boost::log::add_common_attributes();
 
     // Set the directory for writing Bloom filters
-    archive_dir = "archive";
+    archive_dir = archive_path(opts_.name);
+    segment_name_ = segment_name(opts_.name);
 
     // Clear shared memory object if it exists before creation
-    boost::interprocess::shared_memory_object::remove("CacheSharedMemory");
-
-    // Work out optimum parameters
-    double ln2 = std::log(2);
-    // Num. bits - https://en.wikipedia.org/wiki/Bloom_filter
-    // m = -(nln(p))/(ln2^2) where n = num objects, p = false pos rate
-    size_t m = std::ceil(-(((total_capacity * std::log(fp)) / ln2) / ln2));
-    double frac = (double)m / (double)total_capacity;
-    // Num. hash functions
-    // k = (m/n)*ln2
-    k = std::ceil(frac * ln2);
+    boost::interprocess::shared_memory_object::remove(segment_name_.c_str());
+    boost::system::error_code ec;
+    boost::filesystem::remove(huge_page_path(opts_.name), ec);
+    boost::interprocess::shared_memory_object::remove(
+        stats_name(opts_.name).c_str());
+    if (opts_.stats) open_stats(opts_.name);
 
     size_t num_filters =
         std::ceil((double)min_filterlifespan / (double)min_filterduration) + 1;
 
-    // Give 10KB per filter for deque overhead and padding
+    // Work out optimum parameters, the capacity is shared evenly among the
+    // filters
+    filter_capacity_ = std::max<size_t>(1, total_capacity / num_filters);
+    filter_geometry((double)total_capacity / num_filters, fp, opts_.blocked,
+                    opts_.fold_after > 0, filter_size, k);
+
+    // Every filter starts with a first stage of whole chunks of a single
+    // slab, folded ones need less the older they are. The headroom is kept
+    // for the stages chained to them.
+    size_t base_words =
+        bf::shm_bloom_filter::num_words(filter_size, opts_.blocked);
+    size_t reserve_chunks = std::ceil(num_filters * chunks(base_words) *
+                                      std::max(0.0, opts_.stage_headroom));
+    size_t num_chunks = reserve_chunks;
+    for (size_t age = 0; age < num_filters; ++age) {
+        size_t words = base_words;
+        for (size_t f = fold_target(age); f > 0; --f)
+            if (words >= 2 * bf::chunk_words) words /= 2;
+        num_chunks += chunks(words);
+    }
+    stage_reserve_ = reserve_chunks * bf::chunk_words;
+    // A lifespan of filters reaches into one more group than it fills
+    size_t num_summaries = 0;
+    if (opts_.summary_group) {
+        filter_geometry((double)filter_capacity_ * opts_.summary_group, fp,
+                        opts_.blocked, false, summary_size_, summary_k_);
+        num_summaries =
+            (num_filters + opts_.summary_group - 1) / opts_.summary_group + 1;
+        num_chunks += num_summaries *
+                      chunks(bf::shm_bloom_filter::num_words(summary_size_,
+                                                             opts_.blocked));
+    }
+    std::fill(hourly_seen_, hourly_seen_ + 24, false);
+    size_t slab_bytes = num_chunks * bf::chunk_words * sizeof(bf::block_t);
+    // Each filter and stage splits at most one free run in two
+    size_t max_extents = num_filters * max_stages + num_summaries + 1;
+
+    // Every object in the segment is sized exactly, beside the headers of
+    // the segment manager itself and of the six allocations made from it,
+    // the buffer, the slab, the dirty flags, the ring, the summaries and
+    // the free runs, and the alignment of the slab
+    size_t segment_size =
+        bf::segment_manager_t::get_min_size() + sizeof(cache_buffer) +
+        slab_bytes + bf::cache_line_bytes + num_chunks +
+        num_filters * sizeof(bf_pair) +
+        num_summaries * sizeof(summary_filter) +
+        max_extents * sizeof(extent) + 6 * allocation_overhead;
+    create_segment(segment_size);
     BOOST_LOG_SEV(lg, boost::log::trivial::info)
-        << "New cache instantiated with " << m + num_filters * 10000
+        << "New cache instantiated with " << segment_->get_size()
         << " bytes.";
-    segment_ = new boost::interprocess::managed_shared_memory(
-        boost::interprocess::create_only, "CacheSharedMemory",
-        m + num_filters * 10000);
     buf_ = segment_->construct<cache_buffer>("MarkerCache")(get_allocator());
     assert(segment_->find<cache_buffer>("MarkerCache").first != NULL);
+    buf_->segment_bytes = segment_size;
 
-    mutex = segment_->find_or_construct<
-        boost::interprocess::interprocess_sharable_mutex>("CacheMutex")();
+    // Allocate the words of every filter once, ageing only ever recycles
+    // them
+    buf_->slab = static_cast<bf::block_t*>(
+        segment_->allocate_aligned(slab_bytes, bf::cache_line_bytes));
+    buf_->slab_words = num_chunks * bf::chunk_words;
+#ifdef MADV_HUGEPAGE
+    if (opts_.huge_pages && !hugetlb_) {
+        // Transparent huge pages for shared memory, where the host allows
+        // them for mappings which ask
+        uintptr_t page = sysconf(_SC_PAGESIZE);
+        uintptr_t first = (uintptr_t)buf_->slab.get() & ~(page - 1);
+        madvise((void*)first,
+                slab_bytes + ((uintptr_t)buf_->slab.get() - first),
+                MADV_HUGEPAGE);
+    }
+#endif
+    buf_->dirty =
+        static_cast<bf::dirty_t*>(segment_->allocate(num_chunks));
+    for (size_t c = 0; c < num_chunks; ++c)
+        new (&buf_->dirty[c]) bf::dirty_t(0);
+    buf_->free_chunks.reserve(max_extents);
+    buf_->free_chunks.push_back(extent(0, num_chunks));
+    buf_->slots.resize(num_filters);
+    buf_->summaries.resize(num_summaries);
+    // Summaries keep their words for the life of the cache at the top of
+    // the slab, groups of filters take turns at them
+    for (size_t s = 0; s < num_summaries; ++s)
+        buf_->summaries[s].filter = bf::shm_bloom_filter(
+            allocate(bf::shm_bloom_filter::num_words(summary_size_,
+                                                     opts_.blocked),
+                     true),
+            summary_size_, summary_k_, opts_.blocked, opts_.hash);
 
-    filter_size = std::ceil((double)m / (double)num_filters);
+    // Sealed filters are written out by a single background thread
+    persist_thread_ = std::thread(&marker_cache::persist_loop, this);
 
     std::vector<boost::filesystem::path> v;
     time_t now = time(NULL);
@@ -56,14 +245,21 @@ marker_cache::marker_cache(size_t min_filterduration, size_t min_filterlifespan,
 
         // Load list of saved filters
         while (it != boost::filesystem::directory_iterator()) {
-            if (it->path().extension() == ".filter") {
+            if (it->path().extension() == ".checkpoint" &&
+                boost::filesystem::exists(
+                    boost::filesystem::path(it->path())
+                        .replace_extension(".filter"))) {
+                // The filter was archived after it was sealed
+                boost::filesystem::remove(it->path());
+            } else if (it->path().extension() == ".filter" ||
+                       it->path().extension() == ".checkpoint") {
                 // Extract the timestamp and ignore outdated filters
                 if (std::stoi(
                         it->path().filename().replace_extension("").string()) +
                         sec_filterduration * num_filters >=
                     now) {
-                    // Active filter
-                    v.push_back(it->path());
+                    // Active filter, later stages are found from the first
+                    if (!is_stage_file(it->path())) v.push_back(it->path());
                 } else {
                     // Clear the disk
                     boost::filesystem::remove(it->path());
@@ -74,6 +270,8 @@ marker_cache::marker_cache(size_t min_filterduration, size_t min_filterlifespan,
     }
 
     // Load any detected filters into the buffer
+    // Their slots and timeranges are taken from the headers first, the words
+    // are then read in parallel and the filters answer maybe until they are
     std::sort(v.begin(), v.end());
     BOOST_LOG_SEV(lg, boost::log::trivial::trace)
         << "Attempting to load filters from disk:";
@@ -81,200 +279,1601 @@ marker_cache::marker_cache(size_t min_filterduration, size_t min_filterlifespan,
     for (std::vector<boost::filesystem::path>::reverse_iterator i = v.rbegin();
          i != v.rend(); ++i) {
         // Stop loading if capacity reached, reserve space for current filter
-        if (buf_->size() >= num_filters - 1) break;
+        if (buf_->size >= num_filters - 1) break;
+
+        // Filters are read straight into the free slot before the oldest,
+        // which readers can't see yet
+        size_t slot = (buf_->head + num_filters - 1) % num_filters;
+        bf_pair& b = buf_->slots[slot];
+        try {
+            if (bf::is_archive(i->string())) {
+                load_job job = {slot, std::vector<std::string>(), false};
+                for (size_t s = 0; s < max_stages; ++s) {
+                    boost::filesystem::path path = *i;
+                    if (s > 0) {
+                        path = timestamp_to_filepath(
+                            b.first.first, i->extension().c_str(), s);
+                        if (!boost::filesystem::exists(path)) break;
+                    }
+                    bf::archive_header h =
+                        bf::read_header(path.string(), buf_->slab_words);
+                    make_room(h.num_words);
+                    bf::block_t* bits = allocate(h.num_words, s > 0);
+                    if (!bits)
+                        throw std::runtime_error("No room for stage " +
+                                                 std::to_string(s));
+                    b.stages[s] = bf::shm_bloom_filter(
+                        bits, h.num_bits, h.num_hashes,
+                        h.flags & bf::archive_blocked, h.reduction(),
+                        h.hash());
+                    ++b.num_stages;
+                    job.paths.push_back(path.string());
+                    if (s > 0) continue;
 
-        std::ifstream ifs(i->string());
-        boost::archive::text_iarchive ia(ifs);
-        bf_pair b(get_allocator());
-        ia >> b;
+                    b.first = timerange(h.start, h.end);
+                    b.folds = h.folds();
+                    b.capacity = design_load(h.num_bits << b.folds);
+                    // A checkpointed filter was current when the owner
+                    // stopped, it is sealed where it would have been and the
+                    // rest rebuilt
+                    job.checkpoint = (h.flags & bf::archive_checkpoint) != 0;
+                    if (job.checkpoint)
+                        b.first.second = h.start + sec_filterduration - 1;
+                }
+                b.loading = true;
+                load_jobs_.push_back(job);
+            } else {
+                // Text archive written before the binary format
+                clear_slot(slot, filter_capacity_);
+                std::ifstream ifs(i->string());
+                boost::archive::text_iarchive ia(ifs);
+                ia >> b;
+            }
+        } catch (const std::exception& e) {
+            BOOST_LOG_SEV(lg, boost::log::trivial::warning)
+                << "Discarded filter: " << *i << " (" << e.what() << ")";
+            release_stages(b);
+            continue;
+        }
         BOOST_LOG_SEV(lg, boost::log::trivial::info)
-            << "Loaded filter: " << b.first.first << " -> " << b.first.second;
-        buf_->push_front(b);
+            << "Found filter: " << b.first.first << " -> " << b.first.second;
+        // The newest filter may become current again
+        for (size_t s = 0; s < b.num_stages; ++s)
+            b.stages[s].track(buf_->dirty.get() +
+                              (b.stages[s].data() - buf_->slab.get()) /
+                                  bf::chunk_words);
+        write_begin();
+        buf_->head = slot;
+        ++buf_->size;
+        write_end();
     }
+
+    // The newest filter is loaded before serving since it may become current,
+    // the rest are shared among the loading threads
+    if (!load_jobs_.empty()) load(load_jobs_[load_next_++]);
+    size_t num_loaders = std::min<size_t>(
+        std::max(1u, std::thread::hardware_concurrency()),
+        load_jobs_.size() - load_next_);
+    for (size_t i = 0; i < num_loaders; ++i)
+        loaders_.push_back(std::thread(&marker_cache::load_loop, this));
+    if (!opts_.lazy_load) wait_loaded();
     BOOST_LOG_SEV(lg, boost::log::trivial::trace) << "Finished loading.";
 
-    if (buf_->empty()) {
+    if (buf_->size == 0) {
         // No filters loaded
         BOOST_LOG_SEV(lg, boost::log::trivial::info) << "New filter at: "
                                                      << now;
-        buf_->push_back(
-            bf_pair(timerange(now, (std::numeric_limits<time_t>::max)()),
-                    bf::shm_bloom_filter(get_allocator(), filter_size, k)));
+        push_back(timerange(now, (std::numeric_limits<time_t>::max)()),
+                  forecast(now));
     } else {
         // Resume the filter from the last stopping point
         // Query the database for markers that lie in the missing timerange
-        while (buf_->back().first.second <= now) {
-            time_t rebuild_start = buf_->back().first.second;
+        while (back().first.second <= now) {
+            time_t rebuild_start = back().first.second;
             time_t rebuild_end = rebuild_start + sec_filterduration - 1;
             BOOST_LOG_SEV(lg, boost::log::trivial::info)
                 << "Rebuilding filter from: " << rebuild_start << " to "
                 << rebuild_end;
-            buf_->push_back(bf_pair(
-                timerange(std::max(buf_->back().first.first + 1, rebuild_start),
-                          rebuild_end),
-                bf::shm_bloom_filter(get_allocator(), filter_size, k)));
+            timerange t(std::max(back().first.first + 1, rebuild_start),
+                        rebuild_end);
+            bf_pair& rebuilt = push_back(t, forecast(t.first));
+            make_current(rebuilt);
 
             // Query the database between the two end points
-            std::vector<std::pair<char*, int>> queried_markers;
+            std::vector<marker> queried_markers;
 
             /* TODO: Insert postgres code here */
 
-            for (std::vector<std::pair<char*, int>>::iterator i =
-                     queried_markers.begin();
-                 i != queried_markers.end(); ++i)
-                insert(i->first, i->second);
+            if (!queried_markers.empty())
+                insert_batch(&queried_markers[0], queried_markers.size());
 
-            // Guarantee the number of filters does not exceed capacity
-            maybe_age();
+            // Guarantee the number of filters does not exceed capacity. The
+            // cycle is forced, a lazy load still running would otherwise
+            // put it off and the ring overflow on the next period.
+            if (back().first.first + sec_filterduration <= time(NULL))
+                maybe_age(true);
         }
     }
 
     // Mark the current filter
-    buf_->back().first.second = (std::numeric_limits<time_t>::max)();
-
-    // Backdate empty filters to allow ageing cycles
-    while (buf_->size() < num_filters)
-        buf_->push_front(
-            bf_pair(timerange(buf_->front().first.first - sec_filterduration,
-                              buf_->front().first.first - 1),
-                    bf::shm_bloom_filter(get_allocator(), filter_size, k)));
-}
-
-marker_cache::marker_cache() : owner_(false) {
-    // The reading process needs to be able to lock the mutex so we do not open
-    // in read-only mode
-    segment_ = new boost::interprocess::managed_shared_memory(
-        boost::interprocess::open_only, "CacheSharedMemory");
-    buf_ = segment_->find<cache_buffer>("MarkerCache").first;
+    write_begin();
+    back().first.second = (std::numeric_limits<time_t>::max)();
+    write_end();
+    make_current(back());
+    // A resumed filter continues from the markers already in it
+    inserted_ = back().stages[back().num_stages - 1].estimated_size();
+
+    // Backdate empty filters to allow ageing cycles, adaptively sized or
+    // folded ones take as little memory as they can since they never take
+    // inserts
+    while (buf_->size < num_filters)
+        push_front(timerange(front().first.first - sec_filterduration,
+                             front().first.first - 1),
+                   opts_.adaptive_sizing || opts_.fold_after
+                       ? 0
+                       : filter_capacity_);
+}
+
+marker_cache::marker_cache(const std::string& name)
+    : shm_(NULL),
+      hugetlb_(NULL),
+      owner_(false),
+      segment_name_(segment_name(name)),
+      stats_region_(NULL),
+      stats_(NULL),
+      current_(NULL),
+      inserted_(0),
+      stage_capacity_(0),
+      roll_over_retry_(false),
+      persist_busy_(false),
+      persist_stop_(false),
+      checkpoint_stages_(0),
+      checkpoint_bytes_(0),
+      load_next_(0),
+      load_done_(0) {
+    // Readers only ever search the filters and take no locks
+    // A cache on huge pages has no shared memory object of that name
+    try {
+        shm_ = new boost::interprocess::managed_shared_memory(
+            boost::interprocess::open_read_only, segment_name_.c_str());
+        segment_ = shm_->get_segment_manager();
+    } catch (const boost::interprocess::interprocess_exception&) {
+        if (!boost::filesystem::exists(huge_page_path(name))) throw;
+        hugetlb_ = new boost::interprocess::managed_mapped_file(
+            boost::interprocess::open_read_only,
+            huge_page_path(name).c_str());
+        segment_ = hugetlb_->get_segment_manager();
+    }
+    // The mapping is read only, the segment's mutex can't be taken
+    buf_ = segment_->find_no_lock<cache_buffer>("MarkerCache").first;
     assert(buf_ != NULL);
-    mutex = segment_->find_or_construct<
-        boost::interprocess::interprocess_sharable_mutex>("CacheMutex")();
+    open_stats(name);
 }
 
 marker_cache::~marker_cache() {
-    if (owner_)
-        boost::interprocess::shared_memory_object::remove("CacheSharedMemory");
+    for (size_t i = 0; i < loaders_.size(); ++i) loaders_[i].join();
+    if (persist_thread_.joinable()) {
+        // Drain the queue before the filters go away
+        {
+            std::lock_guard<std::mutex> lock(persist_mutex_);
+            persist_stop_ = true;
+        }
+        persist_cv_.notify_one();
+        persist_thread_.join();
+    }
+    if (owner_ && shm_)
+        boost::interprocess::shared_memory_object::remove(
+            segment_name_.c_str());
+    if (owner_ && hugetlb_) {
+        boost::system::error_code ec;
+        boost::filesystem::remove(huge_page_path(opts_.name), ec);
+    }
+    if (owner_ && stats_)
+        boost::interprocess::shared_memory_object::remove(
+            stats_name(opts_.name).c_str());
 
-    delete segment_;
+    delete shm_;
+    delete hugetlb_;
+    delete stats_region_;
 }
 
-bool marker_cache::lookup_from(time_t start, time_t end, char* data,
+bool marker_cache::lookup_from(time_t start, time_t end, const void* data,
                                int data_len) const {
+    // Hash once for the full iteration, per hash function the filters in the
+    // timerange were built with
+    probe_key key(data, data_len);
+    return lookup_from(start, end, key);
+}
+
+bool marker_cache::lookup_from(time_t start, time_t end, hash128_t hash,
+                               bf::hash_id id) const {
+    probe_key key(hash, id);
+    return lookup_from(start, end, key);
+}
+
+bool marker_cache::lookup_from(time_t start, time_t end, const void* data,
+                               int data_len, hash128_t hash,
+                               bf::hash_id id) const {
+    probe_key key(data, data_len, hash, id);
+    return lookup_from(start, end, key);
+}
+
+boost::dynamic_bitset<> marker_cache::lookup_from(const timerange* ranges,
+                                                  size_t num_ranges,
+                                                  const void* data,
+                                                  int data_len) const {
+    probe_key key(data, data_len);
+    return lookup_from(ranges, num_ranges, key);
+}
+
+boost::dynamic_bitset<> marker_cache::lookup_from(const timerange* ranges,
+                                                  size_t num_ranges,
+                                                  hash128_t hash,
+                                                  bf::hash_id id) const {
+    probe_key key(hash, id);
+    return lookup_from(ranges, num_ranges, key);
+}
+
+std::vector<marker_cache::timerange> marker_cache::lookup_ranges(
+    time_t start, time_t end, const void* data, int data_len) const {
+    probe_key key(data, data_len);
+    return lookup_ranges(start, end, key);
+}
+
+std::vector<marker_cache::timerange> marker_cache::lookup_ranges(
+    time_t start, time_t end, hash128_t hash, bf::hash_id id) const {
+    probe_key key(hash, id);
+    return lookup_ranges(start, end, key);
+}
+
+bool marker_cache::lookup_from(time_t start, time_t end,
+                               probe_key& key) const {
     // Invalid timerange
     if (start > end) return false;
-    // Reference to deleted data
-    if (end < buf_->front().first.first) return false;
-
-    // Hash once for the full iteration
-    hash128_t h = bf::shm_bloom_filter::hash(data, data_len);
-
-    timerange search_period = timerange(start, end);
-    bool within_search_period = false;
-
-    // Allow multiple threads from SD to lookup data
-    boost::interprocess::sharable_lock<
-        boost::interprocess::interprocess_sharable_mutex>
-        lock(*mutex);
-
-    // Iterate through the buffer, searching in the overlapping timerange
-    // Searches are more likely to be on recent data, start from the end
-    for (cache_buffer::reverse_iterator i = buf_->rbegin(); i != buf_->rend();
-         ++i) {
-        if (!overlapping_timerange(search_period, i->first)) {
-            if (!within_search_period) {
+    uint64_t started = stats_ ? now_ns() : 0;
+
+    // Retry if the owner changed the ring while it was being searched
+    for (;;) {
+        uint64_t generation = read_begin();
+        size_t head = buf_->head;
+        size_t num_filters = buf_->slots.size();
+        bool found = false;
+        size_t summary = no_summary;
+        bool ruled_out = false;
+
+        // Only visit the filters overlapping the timerange, starting from the
+        // newest since searches are more likely to be on recent data
+        for (size_t i = filters_starting_by(end); i-- > 0;) {
+            const bf_pair& b = buf_->slots[(head + i) % num_filters];
+            if (b.first.second < start) break;
+            if (summary_rules_out(head, i, start, key, summary, ruled_out))
                 continue;
-            } else {
+            if (probe(b, key)) {
+                found = true;
                 break;
             }
         }
-        within_search_period = true;
-        if (i->second.lookup(h)) return true;
+
+        if (read_validate(generation)) {
+            count_lookups(started, 1, found, key.probes);
+            return found;
+        }
     }
+}
 
-    return false;
+std::vector<marker_cache::timerange> marker_cache::lookup_ranges(
+    time_t start, time_t end, probe_key& key) const {
+    std::vector<timerange> found;
+    // Invalid timerange
+    if (start > end) return found;
+    uint64_t started = stats_ ? now_ns() : 0;
+
+    // Retry if the owner changed the ring while it was being searched
+    for (;;) {
+        uint64_t generation = read_begin();
+        size_t head = buf_->head;
+        size_t num_filters = buf_->slots.size();
+        found.clear();
+        size_t summary = no_summary;
+        bool ruled_out = false;
+
+        // Every filter overlapping the timerange is probed, there is no early
+        // exit on the first match
+        for (size_t i = filters_starting_by(end); i-- > 0;) {
+            const bf_pair& b = buf_->slots[(head + i) % num_filters];
+            if (b.first.second < start) break;
+            if (summary_rules_out(head, i, start, key, summary, ruled_out))
+                continue;
+            if (probe(b, key))
+                found.push_back(timerange(std::max(start, b.first.first),
+                                          std::min(end, b.first.second)));
+        }
+
+        if (read_validate(generation)) {
+            count_lookups(started, 1, !found.empty(), key.probes);
+            std::reverse(found.begin(), found.end());
+            return found;
+        }
+    }
 }
 
-void marker_cache::insert(char* data, int data_len) {
-    // Note: We do not need to acquire a lock while inserting since ageing will
-    // not invalidate references to data that was not deleted
-    buf_->back().second.insert(bf::shm_bloom_filter::hash(data, data_len));
+boost::dynamic_bitset<> marker_cache::lookup_from(const timerange* ranges,
+                                                  size_t num_ranges,
+                                                  probe_key& key) const {
+    boost::dynamic_bitset<> found(num_ranges);
+    // Ranges still unanswered, invalid ones are never found
+    std::vector<size_t> pending;
+    uint64_t started = stats_ ? now_ns() : 0;
+
+    // Retry if the owner changed the ring while it was being searched
+    for (;;) {
+        uint64_t generation = read_begin();
+        size_t head = buf_->head;
+        size_t num_filters = buf_->slots.size();
+
+        found.reset();
+        pending.clear();
+        time_t start = (std::numeric_limits<time_t>::max)();
+        time_t end = (std::numeric_limits<time_t>::min)();
+        for (size_t r = 0; r < num_ranges; ++r) {
+            if (ranges[r].first > ranges[r].second) continue;
+            pending.push_back(r);
+            start = std::min(start, ranges[r].first);
+            end = std::max(end, ranges[r].second);
+        }
+
+        // Each filter overlapping any of the ranges is probed once, newest
+        // first, and answers every pending range it overlaps
+        for (size_t i = pending.empty() ? 0 : filters_starting_by(end);
+             i-- > 0;) {
+            const bf_pair& b = buf_->slots[(head + i) % num_filters];
+            if (b.first.second < start) break;
+
+            bool overlaps = false;
+            for (size_t j = 0; j < pending.size() && !overlaps; ++j)
+                overlaps = ranges[pending[j]].first <= b.first.second &&
+                           ranges[pending[j]].second >= b.first.first;
+            if (!overlaps || !probe(b, key)) continue;
+
+            size_t remaining = 0;
+            for (size_t j = 0; j < pending.size(); ++j) {
+                const timerange& r = ranges[pending[j]];
+                if (r.first <= b.first.second && r.second >= b.first.first)
+                    found.set(pending[j]);
+                else
+                    pending[remaining++] = pending[j];
+            }
+            pending.resize(remaining);
+            if (pending.empty()) break;
+        }
+
+        if (read_validate(generation)) {
+            count_lookups(started, 1, found.any(), key.probes);
+            return found;
+        }
+    }
+}
+
+boost::dynamic_bitset<> marker_cache::lookup_from_batch(
+    time_t start, time_t end, const marker* markers,
+    size_t num_markers) const {
+    boost::dynamic_bitset<> found(num_markers);
+    // Invalid timerange
+    if (start > end || num_markers == 0) return found;
+
+    // The whole batch is hashed before the first filter built with each
+    // hash function is probed
+    std::vector<const void*> data(num_markers);
+    std::vector<int> data_len(num_markers);
+    for (size_t j = 0; j < num_markers; ++j) {
+        data[j] = markers[j].first;
+        data_len[j] = markers[j].second;
+    }
+    std::vector<hash128_t> hashes[bf::num_hash_ids];
+
+    std::vector<size_t> pending;
+    // Markers the summary of the group being searched ruled out, they are
+    // pending again once the search leaves the group
+    std::vector<size_t> ruled_out;
+    uint64_t started = stats_ ? now_ns() : 0;
+    size_t probes = 0;
+
+    // Retry the batch if the owner changed the ring while it was searched
+    for (;;) {
+        uint64_t generation = read_begin();
+        size_t head = buf_->head;
+        size_t num_filters = buf_->slots.size();
+        size_t summary = no_summary;
+
+        // Markers not found yet, only these are probed in older filters
+        found.reset();
+        pending.resize(num_markers);
+        for (size_t j = 0; j < num_markers; ++j) pending[j] = j;
+        ruled_out.clear();
+
+        for (size_t i = filters_starting_by(end); i-- > 0;) {
+            const bf_pair& b = buf_->slots[(head + i) % num_filters];
+            if (b.first.second < start) break;
+
+            // Probe the summary of each group the search enters once, under
+            // the same conditions as a single lookup does
+            if (b.summary != summary) {
+                pending.insert(pending.end(), ruled_out.begin(),
+                               ruled_out.end());
+                ruled_out.clear();
+                summary = b.summary;
+                const bf_pair* older =
+                    i ? &buf_->slots[(head + i - 1) % num_filters] : NULL;
+                if (summary < buf_->summaries.size() && older &&
+                    older->summary == summary &&
+                    older->first.second >= start) {
+                    const bf::shm_bloom_filter filter =
+                        buf_->summaries[summary].filter;
+                    bf::hash_id id = filter.hash_function();
+                    if (in_slab(filter) && id < bf::num_hash_ids) {
+                        std::vector<hash128_t>& h =
+                            batch_hashes(hashes[id], id, data, data_len);
+                        probes += pending.size();
+                        size_t remaining = 0;
+                        for (size_t j = 0; j < pending.size(); ++j) {
+                            if (filter.lookup(h[pending[j]]))
+                                pending[remaining++] = pending[j];
+                            else
+                                ruled_out.push_back(pending[j]);
+                        }
+                        pending.resize(remaining);
+                    }
+                }
+            }
+
+            // A filter still being loaded may hold anything
+            if (__atomic_load_n(&b.loading, __ATOMIC_ACQUIRE)) {
+                for (size_t j = 0; j < pending.size(); ++j)
+                    found.set(pending[j]);
+                pending.clear();
+                break;
+            }
+
+            size_t num_stages = std::min(b.num_stages, max_stages);
+            for (size_t s = 0; s < num_stages && !pending.empty(); ++s) {
+                const bf::shm_bloom_filter filter = b.stages[s];
+                bf::hash_id id = filter.hash_function();
+                if (!in_slab(filter) || id >= bf::num_hash_ids) continue;
+                std::vector<hash128_t>& h =
+                    batch_hashes(hashes[id], id, data, data_len);
+
+                // Keep the probes for the next few markers in flight while
+                // probing the current one
+                for (size_t j = 0;
+                     j < pending.size() && j < prefetch_distance; ++j)
+                    filter.prefetch(h[pending[j]]);
+
+                probes += pending.size();
+                size_t remaining = 0;
+                for (size_t j = 0; j < pending.size(); ++j) {
+                    if (j + prefetch_distance < pending.size())
+                        filter.prefetch(h[pending[j + prefetch_distance]]);
+                    if (filter.lookup(h[pending[j]]))
+                        found.set(pending[j]);
+                    else
+                        pending[remaining++] = pending[j];
+                }
+                pending.resize(remaining);
+            }
+            if (pending.empty() && ruled_out.empty()) break;
+        }
+
+        if (read_validate(generation)) {
+            count_lookups(started, num_markers, found.count(), probes);
+            return found;
+        }
+    }
+}
+
+void marker_cache::insert(const void* data, int data_len) {
+    // Note: We do not need to acquire a lock while inserting since ageing
+    // never recycles the filter that was current before it
+    // A thread racing with ageing may still insert into the filter that was
+    // just sealed, which is harmless since it remains in the buffer and is
+    // neither folded nor moved until the next cycle
+    uint64_t started = stats_ ? now_ns() : 0;
+    bf::shm_bloom_filter* filter = current_.load(std::memory_order_acquire);
+    hash128_t h =
+        bf::shm_bloom_filter::hash(data, data_len, filter->hash_function());
+    // The summary first, a marker found in a filter is then always in its
+    // summary too
+    bf::shm_bloom_filter* summary = summary_of(filter);
+    if (summary) summary->insert(h, opts_.multi_writer);
+    filter->insert(h, opts_.multi_writer);
+    if (count_inserts(1)) roll_over(filter);
+    if (stats_) {
+        stats_->inserts.fetch_add(1, std::memory_order_relaxed);
+        record(stats_->insert_latency, now_ns() - started);
+    }
+}
+
+void marker_cache::insert_batch(const marker* markers, size_t num_markers) {
+    uint64_t started = stats_ ? now_ns() : 0;
+    bf::shm_bloom_filter* current = current_.load(std::memory_order_acquire);
+    const void* data[insert_chunk];
+    int data_len[insert_chunk];
+    hash128_t h[insert_chunk];
+
+    // Work through the batch in chunks small enough for the hashes to stay in
+    // L1 between hashing and setting the bits
+    for (size_t base = 0; base < num_markers; base += insert_chunk) {
+        bf::shm_bloom_filter& filter = *current;
+        bf::shm_bloom_filter* summary = summary_of(current);
+        size_t n = std::min(insert_chunk, num_markers - base);
+        for (size_t j = 0; j < n; ++j) {
+            data[j] = markers[base + j].first;
+            data_len[j] = markers[base + j].second;
+        }
+        bf::shm_bloom_filter::hash(data, data_len, n, h,
+                                   filter.hash_function());
+
+        for (size_t j = 0; j < n && j < prefetch_distance; ++j)
+            filter.prefetch(h[j]);
+        for (size_t j = 0; j < n; ++j) {
+            if (j + prefetch_distance < n)
+                filter.prefetch(h[j + prefetch_distance]);
+            if (summary) summary->insert(h[j], opts_.multi_writer);
+            filter.insert(h[j], opts_.multi_writer);
+        }
+        // The rest of the batch goes into a new stage once this one is full
+        if (count_inserts(n)) {
+            roll_over(current);
+            current = current_.load(std::memory_order_acquire);
+        }
+    }
+    if (stats_) {
+        stats_->inserts.fetch_add(num_markers, std::memory_order_relaxed);
+        record(stats_->insert_latency, now_ns() - started);
+    }
+}
+
+bool marker_cache::count_inserts(size_t n) {
+    // A single writer owns the count, several share it
+    size_t before;
+    if (opts_.multi_writer) {
+        before = inserted_.fetch_add(n, std::memory_order_relaxed);
+    } else {
+        before = inserted_.load(std::memory_order_relaxed);
+        inserted_.store(before + n, std::memory_order_relaxed);
+    }
+    size_t capacity = stage_capacity_.load(std::memory_order_relaxed);
+    if (before + n < capacity) return false;
+    // A roll over put off while the age mutex was held is retried by the
+    // next insert past the design load
+    return before < capacity ||
+           (roll_over_retry_.load(std::memory_order_relaxed) &&
+            roll_over_retry_.exchange(false, std::memory_order_relaxed));
+}
+
+void marker_cache::roll_over(bf::shm_bloom_filter* full) {
+    // An insert never waits for an ageing cycle, which may be folding or
+    // compacting, the stage keeps taking inserts until a later one gets in
+    std::unique_lock<std::mutex> age_lock(age_mutex_, std::try_to_lock);
+    if (!age_lock.owns_lock()) {
+        roll_over_retry_.store(true, std::memory_order_relaxed);
+        return;
+    }
+    // The filter was sealed meanwhile
+    if (current_.load(std::memory_order_acquire) != full) return;
+
+    bf_pair& b = back();
+    size_t s = b.num_stages;
+    size_t m, stage_k, capacity;
+    bf::block_t* bits = NULL;
+    if (s < max_stages) {
+        stage_geometry(s, b.capacity, m, stage_k, capacity);
+        bits = allocate(bf::shm_bloom_filter::num_words(m, opts_.blocked),
+                        true);
+    }
+    if (!bits) {
+        BOOST_LOG_SEV(lg, boost::log::trivial::warning)
+            << "Filter at: " << b.first.first
+            << " reached its design load with no room for another stage";
+        return;
+    }
+
+    // The stage is cleared before readers can see it
+    b.stages[s] = bf::shm_bloom_filter(bits, m, stage_k, opts_.blocked,
+                                       opts_.hash);
+    b.stages[s].reset();
+    b.stages[s].track(buf_->dirty.get() +
+                      (bits - buf_->slab.get()) / bf::chunk_words);
+    write_begin();
+    ++b.num_stages;
+    write_end();
+    make_current(b);
+    BOOST_LOG_SEV(lg, boost::log::trivial::info)
+        << "Chained stage " << s << " to filter at: " << b.first.first;
+}
+
+void marker_cache::make_current(bf_pair& b) {
+    size_t m, stage_k, capacity;
+    stage_geometry(b.num_stages - 1, b.capacity, m, stage_k, capacity);
+    stage_capacity_.store(capacity, std::memory_order_relaxed);
+    inserted_.store(0, std::memory_order_relaxed);
+    roll_over_retry_.store(false, std::memory_order_relaxed);
+    current_.store(&b.stages[b.num_stages - 1], std::memory_order_release);
+}
+
+void marker_cache::stage_geometry(size_t s, size_t base, size_t& m,
+                                  size_t& k, size_t& capacity) const {
+    if (s == 0 && base == filter_capacity_) {
+        m = filter_size;
+        k = this->k;
+        capacity = filter_capacity_;
+        return;
+    }
+    double growth = std::pow((double)stage_growth, (double)s);
+    filter_geometry(std::max<size_t>(1, base) * growth,
+                    fp_ * std::pow(stage_tightening, (double)s),
+                    opts_.blocked, opts_.fold_after > 0, m, k);
+    capacity = std::max<size_t>(1, base) * growth;
+}
+
+size_t marker_cache::design_load(size_t m) const {
+    double ln2 = std::log(2);
+    return std::max(1.0, m * ln2 * ln2 / -std::log(fp_));
+}
+
+void marker_cache::observe(const bf_pair& b) {
+    // Every stage but the last was filled to its design load
+    size_t inserted = inserted_.load(std::memory_order_relaxed);
+    for (size_t s = 0; s + 1 < b.num_stages; ++s) {
+        size_t m, stage_k, capacity;
+        stage_geometry(s, b.capacity, m, stage_k, capacity);
+        inserted += capacity;
+    }
+    // A period sealed early, or a forced ageing cycle, is not extrapolated
+    // to a whole period
+    time_t elapsed = b.first.second - b.first.first + 1;
+    double rate = (double)inserted / std::max(elapsed, sec_filterduration);
+    recent_rate_ = rate;
+    for (time_t t = b.first.first - b.first.first % 3600; t <= b.first.second;
+         t += 3600) {
+        size_t hour = t % 86400 / 3600;
+        hourly_rate_[hour] =
+            hourly_seen_[hour] ? (hourly_rate_[hour] + rate) / 2 : rate;
+        hourly_seen_[hour] = true;
+    }
+}
+
+size_t marker_cache::forecast(time_t t) const {
+    if (!opts_.adaptive_sizing) return filter_capacity_;
+    // The same hours on earlier days, or the last period, whichever was
+    // busier. Nothing is known about the first period.
+    double rate = recent_rate_;
+    bool seen = rate >= 0;
+    for (time_t h = t - t % 3600; h < t + sec_filterduration; h += 3600) {
+        size_t hour = h % 86400 / 3600;
+        if (!hourly_seen_[hour]) continue;
+        rate = std::max(rate, hourly_rate_[hour]);
+        seen = true;
+    }
+    if (!seen) return filter_capacity_;
+    return std::ceil(rate * sec_filterduration * forecast_headroom);
 }
 
 void marker_cache::maybe_age(bool force) {
-    if (force ||
-        (buf_->back().first.first + sec_filterduration <= time(NULL))) {
+    // Ageing recycles and folds archived filters which must be loaded first.
+    // The wait is never made under the age mutex, where it would hold up the
+    // writers chaining stages, a due cycle is left to a later call instead.
+    if (force) {
+        wait_loaded();
+    } else {
+        std::lock_guard<std::mutex> lock(load_mutex_);
+        if (load_done_ < load_jobs_.size()) return;
+    }
+
+    // Another inserting thread is already running the ageing cycle
+    std::unique_lock<std::mutex> age_lock(age_mutex_, std::try_to_lock);
+    if (!age_lock.owns_lock()) return;
+
+    if (force || (back().first.first + sec_filterduration <= time(NULL))) {
         BOOST_LOG_SEV(lg, boost::log::trivial::trace)
             << "Started an ageing cycle: ";
+        uint64_t started = stats_ ? now_ns() : 0;
 
         time_t now = time(NULL);
         // Set finishing time for the current filter
-        buf_->back().first.second = std::max(now, buf_->back().first.first);
+        write_begin();
+        back().first.second = std::max(now, back().first.first);
+        write_end();
 
         // Delete the outdated filter, only keep active filters on disk
         BOOST_LOG_SEV(lg, boost::log::trivial::info)
-            << "Cleared filter: " << buf_->front().first.first;
-        boost::filesystem::path path =
-            timestamp_to_filepath(buf_->front().first.first);
-        boost::filesystem::remove(path);
-
-        // Remove the filter from memory
-        // Forbid searching while ageing the data since removing elements will
-        // invalidate the cache_buffer iterators
-        boost::interprocess::scoped_lock<
-            boost::interprocess::interprocess_sharable_mutex>
-            lock(*mutex);
-        buf_->pop_front();
+            << "Cleared filter: " << front().first.first;
+        persist_job job = {true, buf_->head, front().first, false};
+        {
+            std::lock_guard<std::mutex> lock(persist_mutex_);
+            persist_queue_.push_back(job);
+        }
+        persist_cv_.notify_one();
 
+        // Readers stop seeing the outdated filter before its slot is reused
         // Enforce unique starting points for the filters
-        buf_->push_back(
-            bf_pair(timerange(buf_->back().first.second + 1,
-                              (std::numeric_limits<time_t>::max)()),
-                    bf::shm_bloom_filter(get_allocator(), filter_size, k)));
+        timerange next(back().first.second + 1,
+                       (std::numeric_limits<time_t>::max)());
+        if (opts_.adaptive_sizing) observe(back());
+
+        // Fold the filters which reach their next tier with this cycle,
+        // before the new filter needs their memory. The outdated filter and
+        // the one just sealed, which racing inserts may still reach, are
+        // left alone.
+        for (size_t i = 1; opts_.fold_after && i + 1 < buf_->size; ++i) {
+            bf_pair& b = buf_->at(i);
+            if (b.folds >= fold_target(buf_->size - i)) continue;
+            size_t slot = (buf_->head + i) % buf_->slots.size();
+            fold(b);
+            persist_job job = {false, slot, b.first, true};
+            std::lock_guard<std::mutex> lock(persist_mutex_);
+            queue(job);
+        }
+
+        pop_front();
+        make_current(push_back(next, forecast(next.first)));
         BOOST_LOG_SEV(lg, boost::log::trivial::info)
-            << "New filter at: " << buf_->back().first.first;
+            << "New filter at: " << back().first.first;
 
-        // No need for mutex on the save
-        lock.unlock();
         save();
+        if (stats_) {
+            stats_->ageing_cycles.fetch_add(1, std::memory_order_relaxed);
+            record(stats_->age_latency, now_ns() - started);
+        }
         BOOST_LOG_SEV(lg, boost::log::trivial::trace)
             << "Ended an ageing cycle.";
     }
+
+    // Stages are chained on the insert path, which only takes a free run as
+    // it is, compact here so that the next one of the current filter fits
+    bf_pair& b = back();
+    if (b.num_stages < max_stages) {
+        size_t m, stage_k, capacity;
+        stage_geometry(b.num_stages, b.capacity, m, stage_k, capacity);
+        make_room(bf::shm_bloom_filter::num_words(m, opts_.blocked));
+    }
+}
+
+bf::void_allocator marker_cache::get_allocator() { return segment_; }
+
+void marker_cache::create_segment(size_t size) {
+    if (opts_.huge_pages) {
+        // The file is sized in whole huge pages, all of them are reserved
+        // when it is mapped so a shortage shows here and not as a fault
+        boost::filesystem::path path = huge_page_path(opts_.name);
+        struct statfs fs;
+        if (statfs(huge_page_mount, &fs) == 0 &&
+            (long)fs.f_type == hugetlbfs_magic) {
+            size_t page = fs.f_bsize;
+            try {
+                hugetlb_ = new boost::interprocess::managed_mapped_file(
+                    boost::interprocess::create_only, path.c_str(),
+                    (size + page - 1) / page * page);
+                segment_ = hugetlb_->get_segment_manager();
+                BOOST_LOG_SEV(lg, boost::log::trivial::info)
+                    << "Cache backed by huge pages of " << page << " bytes";
+                return;
+            } catch (const boost::interprocess::interprocess_exception& e) {
+                boost::system::error_code ec;
+                boost::filesystem::remove(path, ec);
+                BOOST_LOG_SEV(lg, boost::log::trivial::warning)
+                    << "No huge pages for the cache (" << e.what() << ")";
+            }
+        } else {
+            BOOST_LOG_SEV(lg, boost::log::trivial::warning)
+                << "No hugetlbfs mounted at " << huge_page_mount;
+        }
+    }
+    shm_ = new boost::interprocess::managed_shared_memory(
+        boost::interprocess::create_only, segment_name_.c_str(), size);
+    segment_ = shm_->get_segment_manager();
+}
+
+marker_cache::memory_usage marker_cache::memory() const {
+    memory_usage usage;
+    usage.allocated = segment_->get_size();
+    // The slack lies past the end of the requested segment, where the
+    // segment manager counts it as free
+    usage.page_slack = usage.allocated > buf_->segment_bytes
+                           ? usage.allocated - buf_->segment_bytes
+                           : 0;
+    usage.free = segment_->get_free_memory() - usage.page_slack;
+    usage.used = usage.allocated - usage.page_slack - usage.free;
+    usage.slab = buf_->slab_words * sizeof(bf::block_t);
+    usage.slab_free = owner_ ? free_words() * sizeof(bf::block_t) : 0;
+    usage.huge_pages = hugetlb_ != NULL;
+    return usage;
+}
+
+bool marker_cache::stats(statistics& out) const {
+    if (!stats_) return false;
+    out.lookups = stats_->lookups.load(std::memory_order_relaxed);
+    out.hits = stats_->hits.load(std::memory_order_relaxed);
+    out.filters_probed = stats_->filters_probed.load(std::memory_order_relaxed);
+    out.inserts = stats_->inserts.load(std::memory_order_relaxed);
+    out.ageing_cycles = stats_->ageing_cycles.load(std::memory_order_relaxed);
+    out.saves = stats_->saves.load(std::memory_order_relaxed);
+    out.save_ns = stats_->save_ns.load(std::memory_order_relaxed);
+    for (size_t b = 0; b < num_latency_buckets; ++b) {
+        out.lookup_latency[b] =
+            stats_->lookup_latency[b].load(std::memory_order_relaxed);
+        out.insert_latency[b] =
+            stats_->insert_latency[b].load(std::memory_order_relaxed);
+        out.age_latency[b] =
+            stats_->age_latency[b].load(std::memory_order_relaxed);
+        out.save_latency[b] =
+            stats_->save_latency[b].load(std::memory_order_relaxed);
+    }
+    return true;
+}
+
+std::vector<marker_cache::filter_statistics> marker_cache::filter_stats()
+    const {
+    std::vector<filter_statistics> filters;
+    // Retry if the owner changed the ring while it was being counted
+    for (;;) {
+        uint64_t generation = read_begin();
+        filters.clear();
+        size_t size = std::min(buf_->size, buf_->slots.size());
+        for (size_t i = 0; i < size; ++i) {
+            const bf_pair& b = buf_->slots[(buf_->head + i) %
+                                           buf_->slots.size()];
+            filter_statistics f = {b.first, 0, 0, 0, 0, 0, false};
+            f.loading = __atomic_load_n(&b.loading, __ATOMIC_ACQUIRE);
+            size_t num_stages = std::min(b.num_stages, max_stages);
+            // A key is a false positive if any stage takes it for a member,
+            // each does so with probability fill^k
+            double miss = 1;
+            for (size_t s = 0; s < num_stages && !f.loading; ++s) {
+                const bf::shm_bloom_filter stage = b.stages[s];
+                if (!in_slab(stage) || !stage.size()) continue;
+                size_t set = stage.set_bits();
+                ++f.stages;
+                f.bits += stage.size();
+                f.set_bits += set;
+                miss *= 1 - std::pow((double)set / stage.size(),
+                                     (double)stage.hashes());
+            }
+            if (f.bits) f.fill = (double)f.set_bits / f.bits;
+            f.fp_rate = f.loading ? 1 : 1 - miss;
+            filters.push_back(f);
+        }
+        if (read_validate(generation)) return filters;
+    }
+}
+
+void marker_cache::open_stats(const std::string& name) {
+    using namespace boost::interprocess;
+    try {
+        if (owner_) {
+            shared_memory_object shm(create_only, stats_name(name).c_str(),
+                                     read_write);
+            shm.truncate(sizeof(shared_stats));
+            stats_region_ = new mapped_region(shm, read_write);
+            stats_ = new (stats_region_->get_address()) shared_stats();
+        } else {
+            shared_memory_object shm(open_only, stats_name(name).c_str(),
+                                     read_write);
+            stats_region_ = new mapped_region(shm, read_write);
+            stats_ = static_cast<shared_stats*>(stats_region_->get_address());
+        }
+    } catch (const interprocess_exception& e) {
+        // The owner keeps no statistics, or they could not be created
+        if (owner_)
+            BOOST_LOG_SEV(lg, boost::log::trivial::warning)
+                << "No statistics for the cache (" << e.what() << ")";
+    }
 }
 
-bf::void_allocator marker_cache::get_allocator() {
-    return segment_->get_segment_manager();
+void marker_cache::count_lookups(uint64_t started, size_t n, size_t hits,
+                                 size_t probes) const {
+    if (!stats_) return;
+    stats_->lookups.fetch_add(n, std::memory_order_relaxed);
+    stats_->hits.fetch_add(hits, std::memory_order_relaxed);
+    stats_->filters_probed.fetch_add(probes, std::memory_order_relaxed);
+    record(stats_->lookup_latency, now_ns() - started);
 }
 
 void marker_cache::save() {
+    {
+        std::lock_guard<std::mutex> lock(persist_mutex_);
+        for (size_t i = 0; i < buf_->size; ++i) {
+            const bf_pair& b = buf_->at(i);
+            // The current filter is still changing
+            if (b.first.second == (std::numeric_limits<time_t>::max)())
+                continue;
+
+            persist_job job = {false, (buf_->head + i) % buf_->slots.size(),
+                               b.first, false};
+            queue(job);
+        }
+        // Only writes are dropped, a filter never removed may be loaded
+        // again on the next start although it is outdated
+        std::deque<persist_job>::iterator it = persist_queue_.begin();
+        while (persist_queue_.size() > 2 * buf_->slots.size() &&
+               it != persist_queue_.end()) {
+            if (it->remove) {
+                ++it;
+                continue;
+            }
+            BOOST_LOG_SEV(lg, boost::log::trivial::warning)
+                << "Disk behind, dropped write of: " << it->range.first;
+            it = persist_queue_.erase(it);
+        }
+    }
+    persist_cv_.notify_one();
+}
+
+void marker_cache::queue(const persist_job& job) {
+    // A newer filter in the slot supersedes any queued write, one that
+    // changed since it was archived is written again
+    std::deque<persist_job>::iterator it = persist_queue_.begin();
+    for (; it != persist_queue_.end(); ++it)
+        if (!it->remove && it->slot == job.slot) break;
+    if (it == persist_queue_.end()) {
+        persist_queue_.push_back(job);
+    } else {
+        bool rewrite = it->rewrite && it->range == job.range;
+        *it = job;
+        it->rewrite |= rewrite;
+    }
+}
+
+void marker_cache::flush() {
+    std::unique_lock<std::mutex> lock(persist_mutex_);
+    while (!persist_queue_.empty() || persist_busy_)
+        persist_done_cv_.wait(lock);
+}
+
+void marker_cache::persist_loop() {
+    std::unique_lock<std::mutex> lock(persist_mutex_);
+    for (;;) {
+        while (persist_queue_.empty() && !persist_stop_) {
+            if (!opts_.checkpoint_interval) {
+                persist_cv_.wait(lock);
+            } else if (persist_cv_.wait_for(
+                           lock,
+                           std::chrono::seconds(opts_.checkpoint_interval)) ==
+                       std::cv_status::timeout) {
+                persist_busy_ = true;
+                lock.unlock();
+                try {
+                    checkpoint();
+                } catch (const std::exception& e) {
+                    BOOST_LOG_SEV(lg, boost::log::trivial::error)
+                        << "Failed to checkpoint (" << e.what() << ")";
+                }
+                lock.lock();
+                persist_busy_ = false;
+            }
+        }
+        if (persist_queue_.empty()) {
+            // Leave a final checkpoint so a restart loses nothing
+            lock.unlock();
+            try {
+                if (opts_.checkpoint_interval) checkpoint();
+            } catch (const std::exception& e) {
+                BOOST_LOG_SEV(lg, boost::log::trivial::error)
+                    << "Failed to checkpoint (" << e.what() << ")";
+            }
+            return;
+        }
+
+        persist_job job = persist_queue_.front();
+        persist_queue_.pop_front();
+        persist_busy_ = true;
+        lock.unlock();
+        try {
+            persist(job);
+        } catch (const std::exception& e) {
+            BOOST_LOG_SEV(lg, boost::log::trivial::error)
+                << "Failed to persist: " << job.range.first << " ("
+                << e.what() << ")";
+        }
+        lock.lock();
+        persist_busy_ = false;
+        persist_done_cv_.notify_all();
+    }
+}
+
+void marker_cache::persist(const persist_job& job) {
+    // Label the file with the starting timestamp
+    boost::filesystem::path path = timestamp_to_filepath(job.range.first);
+    if (job.remove) {
+        for (size_t s = 0; s < max_stages; ++s) {
+            boost::filesystem::remove(
+                timestamp_to_filepath(job.range.first, ".filter", s));
+            boost::filesystem::remove(
+                timestamp_to_filepath(job.range.first, ".checkpoint", s));
+        }
+        return;
+    }
+
+    // Write the filter if it's not already written and is still in memory
+    bf_pair b;
+    if ((boost::filesystem::exists(path) && !job.rewrite) ||
+        !holds(job.slot, job.range, &b))
+        return;
     if (!boost::filesystem::exists(archive_dir))
-        boost::filesystem::create_directory(archive_dir);
-
-    BOOST_LOG_SEV(lg, boost::log::trivial::trace) << "Starting saving cycle:";
-    // During serialization, allocator information is stripped away.
-    for (cache_buffer::iterator i = buf_->begin(); i != buf_->end(); ++i) {
-        // Label the file with the starting timestamp
-        boost::filesystem::path path = timestamp_to_filepath(i->first.first);
-
-        if (i->first.second != (std::numeric_limits<time_t>::max)() &&
-            !boost::filesystem::exists(path)) {
-            // Write the filter if it's not already written and is not current
-            BOOST_LOG_SEV(lg, boost::log::trivial::info) << "Writing to: "
-                                                         << path;
-            std::ofstream ofs(path.string());
-            boost::archive::text_oarchive oa(ofs);
-            oa << *i;
+        boost::filesystem::create_directories(archive_dir);
+    BOOST_LOG_SEV(lg, boost::log::trivial::info) << "Writing to: " << path;
+    // The first stage is written last, once it exists so do the others
+    uint64_t started = stats_ ? now_ns() : 0;
+    size_t bytes = 0;
+    for (size_t s = b.num_stages; s-- > 0;)
+        bytes += bf::write_archive(
+            timestamp_to_filepath(job.range.first, ".filter", s).string(),
+            job.range.first, job.range.second, b.stages[s], b.folds,
+            opts_.compress_archives);
+    BOOST_LOG_SEV(lg, boost::log::trivial::trace)
+        << "Wrote " << bytes << " bytes to: " << path;
+    if (stats_) {
+        uint64_t ns = now_ns() - started;
+        stats_->saves.fetch_add(1, std::memory_order_relaxed);
+        stats_->save_ns.fetch_add(ns, std::memory_order_relaxed);
+        record(stats_->save_latency, ns);
+    }
+
+    // The slot was recycled while it was being written, the archive may be
+    // torn and its filter is outdated anyway. A filter folded or moved
+    // meanwhile is written again.
+    bf_pair after;
+    bool held = holds(job.slot, job.range, &after);
+    bool same = held && after.num_stages == b.num_stages;
+    for (size_t s = 0; same && s < b.num_stages; ++s)
+        same = after.stages[s].data() == b.stages[s].data() &&
+               after.stages[s].size() == b.stages[s].size();
+    if (held && !same) {
+        persist_job again = job;
+        again.rewrite = true;
+        std::lock_guard<std::mutex> lock(persist_mutex_);
+        queue(again);
+        return;
+    }
+    const char* superseded = held ? ".checkpoint" : ".filter";
+    for (size_t s = 0; s < max_stages; ++s)
+        boost::filesystem::remove(
+            timestamp_to_filepath(job.range.first, superseded, s));
+}
+
+void marker_cache::load_loop() {
+    for (size_t i; (i = load_next_++) < load_jobs_.size();) load(load_jobs_[i]);
+}
+
+void marker_cache::load(const load_job& job) {
+    bf_pair& b = buf_->slots[job.slot];
+    try {
+        for (size_t s = 0; s < job.paths.size(); ++s) {
+            bf::block_t* bits = b.stages[s].data();
+            if (job.checkpoint)
+                bf::read_checkpoint(job.paths[s], bits, stage_words(b, s));
+            else
+                bf::read_archive(job.paths[s], bits, stage_words(b, s));
         }
+        BOOST_LOG_SEV(lg, boost::log::trivial::info)
+            << "Loaded filter: " << b.first.first << " -> " << b.first.second;
+    } catch (const std::exception& e) {
+        // The timerange is already published, it is left empty
+        BOOST_LOG_SEV(lg, boost::log::trivial::warning)
+            << "Discarded filter: " << job.paths[0] << " (" << e.what()
+            << ")";
+        for (size_t s = 0; s < b.num_stages; ++s) b.stages[s].reset();
     }
-    BOOST_LOG_SEV(lg, boost::log::trivial::trace) << "Finished saving.";
+    {
+        std::lock_guard<std::mutex> lock(load_mutex_);
+        __atomic_store_n(&b.loading, false, __ATOMIC_RELEASE);
+        ++load_done_;
+    }
+    load_cv_.notify_all();
 }
 
-bool marker_cache::overlapping_timerange(timerange fst, timerange snd) const {
-    // Assume ranges are valid
-    return (fst.first <= snd.second) && (snd.first <= fst.second);
+void marker_cache::wait_loaded() {
+    std::unique_lock<std::mutex> lock(load_mutex_);
+    while (load_done_ < load_jobs_.size()) load_cv_.wait(lock);
+}
+
+void marker_cache::checkpoint() {
+    if (!current_.load(std::memory_order_acquire)) return;
+    // The stages of the current filter are only ever added to and stay in
+    // place until it is sealed, which is checked below
+    size_t slot;
+    timerange range;
+    size_t num_stages;
+    for (;;) {
+        uint64_t generation = read_begin();
+        slot = (buf_->head + buf_->size - 1) % buf_->slots.size();
+        range = buf_->slots[slot].first;
+        num_stages = buf_->slots[slot].num_stages;
+        if (read_validate(generation)) break;
+    }
+    // Sealed while this ran, the archive written for it covers it
+    if (range.second != (std::numeric_limits<time_t>::max)()) return;
+
+    if (!boost::filesystem::exists(archive_dir))
+        boost::filesystem::create_directories(archive_dir);
+    const bf_pair& b = buf_->slots[slot];
+    size_t words = 0;
+    for (size_t s = 0; s < num_stages; ++s) words += stage_words(b, s);
+
+    // Start new files for a new filter, or once the records outgrow the
+    // filter itself
+    bool rewrite = range != checkpoint_range_ ||
+                   checkpoint_bytes_ > words * sizeof(bf::block_t);
+    for (size_t s = 0; s < num_stages; ++s) {
+        const bf::shm_bloom_filter& stage = b.stages[s];
+        boost::filesystem::path path =
+            timestamp_to_filepath(range.first, ".checkpoint", s);
+        size_t first = (stage.data() - buf_->slab.get()) / bf::chunk_words;
+        size_t num_chunks =
+            bf::shm_bloom_filter::num_chunks(stage.size(), stage.blocked());
+
+        // Flags are cleared before their chunks are copied, bits set
+        // meanwhile flag their chunk again for the next checkpoint
+        std::vector<size_t> chunks;
+        for (size_t c = 0; c < num_chunks; ++c)
+            if (buf_->dirty[first + c].exchange(0, std::memory_order_acq_rel))
+                chunks.push_back(c);
+
+        if (rewrite || s >= checkpoint_stages_)
+            bf::write_checkpoint(path.string(), range.first, range.second,
+                                 stage);
+        else if (!chunks.empty())
+            checkpoint_bytes_ +=
+                bf::append_checkpoint(path.string(), stage, chunks);
+    }
+    if (rewrite) {
+        checkpoint_range_ = range;
+        checkpoint_bytes_ = 0;
+    }
+    checkpoint_stages_ = num_stages;
+}
+
+bool marker_cache::holds(size_t slot, const timerange& range,
+                         bf_pair* snapshot) const {
+    for (;;) {
+        uint64_t generation = read_begin();
+        size_t num_filters = buf_->slots.size();
+        bool in_use = (slot + num_filters - buf_->head) % num_filters <
+                      buf_->size;
+        bool held = in_use && buf_->slots[slot].first == range &&
+                    !__atomic_load_n(&buf_->slots[slot].loading,
+                                     __ATOMIC_ACQUIRE);
+        if (held && snapshot) *snapshot = buf_->slots[slot];
+        if (read_validate(generation)) return held;
+    }
+}
+
+size_t marker_cache::fold_target(size_t age) const {
+    if (!opts_.fold_after || age < 1) return 0;
+    return std::min(opts_.max_folds, (age - 1) / opts_.fold_after);
+}
+
+void marker_cache::fold(bf_pair& b) {
+    for (size_t s = 0; s < b.num_stages; ++s) {
+        bf::shm_bloom_filter& stage = b.stages[s];
+        // With a mask the bits of a filter of m/2 bits, or lines, are those
+        // of the filter of m with both halves OR-ed together. Readers still
+        // probing the whole filter meanwhile only see bits added.
+        size_t words =
+            bf::shm_bloom_filter::num_words(stage.size(), stage.blocked());
+        if (stage.reduction() != bf::reduce_mask ||
+            words < 2 * bf::chunk_words)
+            continue;
+        size_t half = words / 2;
+        bf::block_t* bits = stage.data();
+        for (size_t w = 0; w < half; ++w) bits[w] |= bits[half + w];
+
+        write_begin();
+        stage = bf::shm_bloom_filter(bits, stage.size() / 2, stage.hashes(),
+                                     stage.blocked(), bf::reduce_mask,
+                                     stage.hash_function());
+        stage.track(buf_->dirty.get() +
+                    (bits - buf_->slab.get()) / bf::chunk_words);
+        write_end();
+        release(bits + half, half);
+    }
+    ++b.folds;
+    BOOST_LOG_SEV(lg, boost::log::trivial::info)
+        << "Folded filter at: " << b.first.first << " " << b.folds
+        << " times";
 }
 
-boost::filesystem::path marker_cache::timestamp_to_filepath(time_t t) {
+void marker_cache::compact() {
+    // Filters are moved in address order into the lowest free run below
+    // them that holds them, or slid down into the run right below them,
+    // each published like any other change to the ring. The filter taking
+    // inserts, the one just sealed when racing inserts may still reach it,
+    // and those still loading stay where they are.
+
+    // Midway through an ageing cycle the newest filter is the one just
+    // sealed, its successor is not in the ring yet. Only several writers
+    // can still be inserting into it, a single one is running the cycle.
+    bool has_current = buf_->size && back().first.second ==
+                                         (std::numeric_limits<time_t>::max)();
+    size_t keep = (has_current ? 1 : 0) + (opts_.multi_writer ? 1 : 0);
+    std::vector<std::pair<const bf::block_t*, std::pair<size_t, size_t> > >
+        order;
+    for (size_t i = 0; i + keep < buf_->size; ++i) {
+        size_t slot = (buf_->head + i) % buf_->slots.size();
+        const bf_pair& b = buf_->slots[slot];
+        if (__atomic_load_n(&b.loading, __ATOMIC_ACQUIRE)) continue;
+        for (size_t s = 0; s < b.num_stages; ++s)
+            order.push_back(
+                std::make_pair(b.stages[s].data(), std::make_pair(slot, s)));
+    }
+    std::sort(order.begin(), order.end());
+
+    extent_vector& runs = buf_->free_chunks;
+    for (size_t j = 0; j < order.size(); ++j) {
+        bf_pair& b = buf_->slots[order[j].second.first];
+        bf::shm_bloom_filter& stage = b.stages[order[j].second.second];
+        size_t words = stage_words(b, order[j].second.second);
+        size_t n = chunks(words);
+        size_t at = (stage.data() - buf_->slab.get()) / bf::chunk_words;
+        // A run too short for the filter still takes it if it lies right
+        // below, the filter then slides down over its own words
+        size_t i = 0;
+        while (i < runs.size() && runs[i].first < at &&
+               runs[i].second < n && runs[i].first + runs[i].second != at)
+            ++i;
+        if (i == runs.size() || runs[i].first > at) continue;
+
+        bf::block_t* bits = buf_->slab.get() + runs[i].first * bf::chunk_words;
+        bf::block_t* old = stage.data();
+        size_t gap = runs[i].second;
+        bool slide = gap < n;
+        if (slide) {
+            // Readers retry until the copy is done, the old words are being
+            // overwritten under them
+            runs.erase(runs.begin() + i);
+            write_begin();
+            std::copy(old, old + words, bits);
+        } else {
+            runs[i].first += n;
+            runs[i].second -= n;
+            if (runs[i].second == 0) runs.erase(runs.begin() + i);
+            std::copy(old, old + words, bits);
+            write_begin();
+        }
+        stage = bf::shm_bloom_filter(bits, stage.size(), stage.hashes(),
+                                     stage.blocked(), stage.reduction(),
+                                     stage.hash_function());
+        stage.track(buf_->dirty.get() +
+                    (bits - buf_->slab.get()) / bf::chunk_words);
+        write_end();
+        if (slide)
+            release(bits + n * bf::chunk_words, gap * bf::chunk_words);
+        else
+            release(old, words);
+    }
+    BOOST_LOG_SEV(lg, boost::log::trivial::info)
+        << "Compacted the slab, largest free run " << largest_run()
+        << " words";
+}
+
+void marker_cache::clear_slot(size_t slot, size_t capacity) {
+    // The slot is not visible to readers, its words are released and taken
+    // again and cleared in their own time. With even sizing a recycled first
+    // stage leaves a hole of exactly the words needed.
+    bf_pair& b = buf_->slots[slot];
+    release_stages(b);
+    size_t m, stage_k;
+    stage_geometry(0, capacity, m, stage_k, capacity);
+    size_t words = bf::shm_bloom_filter::num_words(m, opts_.blocked);
+
+    // Take no more than is left, beside the reserve for chained stages when
+    // sizing adaptively. The filter grows stages if it falls short.
+    size_t left = free_words();
+    if (opts_.adaptive_sizing)
+        left = left > stage_reserve_ ? left - stage_reserve_ : 0;
+    left = std::max(left / bf::chunk_words, (size_t)1) * bf::chunk_words;
+    if (opts_.fold_after) left = floor_pow2(left);
+    if (words > left) {
+        if (!opts_.adaptive_sizing)
+            BOOST_LOG_SEV(lg, boost::log::trivial::warning)
+                << "Filter at: " << b.first.first
+                << " shrunk to the memory left";
+        words = left;
+        m = words * bf::bits_per_block_t;
+        capacity = design_load(m);
+    }
+
+    make_room(words);
+    bf::block_t* bits = allocate(words, false);
+    if (!bits) throw std::runtime_error("No room for a new filter");
+    b.stages[0] = bf::shm_bloom_filter(bits, m, stage_k, opts_.blocked,
+                                       opts_.hash);
+    b.stages[0].reset();
+    b.stages[0].track(buf_->dirty.get() +
+                      (bits - buf_->slab.get()) / bf::chunk_words);
+    b.num_stages = 1;
+    b.capacity = capacity;
+}
+
+bf::block_t* marker_cache::allocate(size_t words, bool stage) {
+    size_t n = chunks(words);
+    extent_vector& runs = buf_->free_chunks;
+    for (size_t j = 0; j < runs.size(); ++j) {
+        size_t i = stage ? runs.size() - 1 - j : j;
+        if (runs[i].second < n) continue;
+        size_t first = runs[i].first;
+        if (stage)
+            first += runs[i].second - n;
+        else
+            runs[i].first += n;
+        runs[i].second -= n;
+        if (runs[i].second == 0) runs.erase(runs.begin() + i);
+        return buf_->slab.get() + first * bf::chunk_words;
+    }
+    return NULL;
+}
+
+void marker_cache::make_room(size_t words) {
+    // The free chunks may be there but split up, compacting joins them
+    size_t n = chunks(words) * bf::chunk_words;
+    if (largest_run() < n && free_words() >= n) compact();
+}
+
+void marker_cache::release(const bf::block_t* bits, size_t words) {
+    extent run((bits - buf_->slab.get()) / bf::chunk_words, chunks(words));
+    extent_vector& runs = buf_->free_chunks;
+    size_t i =
+        std::lower_bound(runs.begin(), runs.end(), run) - runs.begin();
+    runs.insert(runs.begin() + i, run);
+    // Merge with the runs either side
+    if (i + 1 < runs.size() &&
+        runs[i].first + runs[i].second == runs[i + 1].first) {
+        runs[i].second += runs[i + 1].second;
+        runs.erase(runs.begin() + i + 1);
+    }
+    if (i > 0 && runs[i - 1].first + runs[i - 1].second == runs[i].first) {
+        runs[i - 1].second += runs[i].second;
+        runs.erase(runs.begin() + i);
+    }
+}
+
+size_t marker_cache::free_words() const {
+    size_t n = 0;
+    for (size_t i = 0; i < buf_->free_chunks.size(); ++i)
+        n += buf_->free_chunks[i].second;
+    return n * bf::chunk_words;
+}
+
+size_t marker_cache::largest_run() const {
+    size_t n = 0;
+    for (size_t i = 0; i < buf_->free_chunks.size(); ++i)
+        n = std::max(n, buf_->free_chunks[i].second);
+    return n * bf::chunk_words;
+}
+
+size_t marker_cache::stage_words(const bf_pair& b, size_t s) const {
+    return chunks(bf::shm_bloom_filter::num_words(b.stages[s].size(),
+                                                  b.stages[s].blocked())) *
+           bf::chunk_words;
+}
+
+void marker_cache::release_stages(bf_pair& b) {
+    for (size_t s = 0; s < b.num_stages; ++s)
+        release(b.stages[s].data(), stage_words(b, s));
+    b.num_stages = 0;
+}
+
+marker_cache::bf_pair& marker_cache::push_back(const timerange& t,
+                                               size_t capacity) {
+    assert(buf_->size < buf_->slots.size());
+    size_t slot = (buf_->head + buf_->size) % buf_->slots.size();
+    bf_pair& b = buf_->slots[slot];
+    b.first = t;
+    // Only filters taking inserts join a summary, backdated and loaded ones
+    // are probed on their own
+    join_summary(b);
+    clear_slot(slot, capacity);
+    write_begin();
+    ++buf_->size;
+    write_end();
+    return b;
+}
+
+marker_cache::bf_pair& marker_cache::push_front(const timerange& t,
+                                                size_t capacity) {
+    assert(buf_->size < buf_->slots.size());
+    size_t slot = (buf_->head + buf_->slots.size() - 1) % buf_->slots.size();
+    bf_pair& b = buf_->slots[slot];
+    b.first = t;
+    b.summary = no_summary;
+    clear_slot(slot, capacity);
+    write_begin();
+    buf_->head = slot;
+    ++buf_->size;
+    write_end();
+    return b;
+}
+
+void marker_cache::pop_front() {
+    size_t s = front().summary;
+    write_begin();
+    buf_->head = (buf_->head + 1) % buf_->slots.size();
+    --buf_->size;
+    write_end();
+    // The summary is free for another group once no filter refers to it
+    if (s == no_summary || (buf_->size > 0 && front().summary == s)) return;
+    buf_->summaries[s].members = 0;
+    if (open_summary_ == s) open_summary_ = no_summary;
+}
+
+void marker_cache::join_summary(bf_pair& b) {
+    b.summary = no_summary;
+    if (!opts_.summary_group) return;
+    if (open_summary_ == no_summary ||
+        buf_->summaries[open_summary_].members >= opts_.summary_group) {
+        open_summary_ = no_summary;
+        size_t s = 0;
+        while (s < buf_->summaries.size() && buf_->summaries[s].members) ++s;
+        if (s == buf_->summaries.size()) {
+            BOOST_LOG_SEV(lg, boost::log::trivial::warning)
+                << "No summary left for filter at: " << b.first.first;
+            return;
+        }
+        // Readers still probing the summary for the group it held retry,
+        // the filters of that group left the ring before it is cleared
+        buf_->summaries[s].filter.reset();
+        open_summary_ = s;
+    }
+    ++buf_->summaries[open_summary_].members;
+    b.summary = open_summary_;
+}
+
+bf::shm_bloom_filter* marker_cache::summary_of(
+    const bf::shm_bloom_filter* stage) {
+    // The stage lies in the slot of its filter, which keeps its summary
+    // until it is recycled
+    size_t slot = (reinterpret_cast<const char*>(stage) -
+                   reinterpret_cast<const char*>(&buf_->slots[0])) /
+                  sizeof(bf_pair);
+    size_t s = buf_->slots[slot].summary;
+    return s == no_summary ? NULL : &buf_->summaries[s].filter;
+}
+
+void marker_cache::write_begin() {
+    buf_->generation.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+void marker_cache::write_end() {
+    buf_->generation.fetch_add(1, std::memory_order_release);
+}
+
+uint64_t marker_cache::read_begin() const {
+    uint64_t generation;
+    while ((generation = buf_->generation.load(std::memory_order_acquire)) & 1)
+        ;
+    return generation;
+}
+
+bool marker_cache::read_validate(uint64_t generation) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return buf_->generation.load(std::memory_order_relaxed) == generation;
+}
+
+marker_cache::probe_key::probe_key(const void* data, int data_len)
+    : probes(0), data(data), data_len(data_len) {
+    std::fill(hashed, hashed + bf::num_hash_ids, false);
+}
+
+marker_cache::probe_key::probe_key(hash128_t hash, bf::hash_id id)
+    : probes(0), data(NULL), data_len(0) {
+    std::fill(hashed, hashed + bf::num_hash_ids, false);
+    h[id] = hash;
+    hashed[id] = true;
+}
+
+marker_cache::probe_key::probe_key(const void* data, int data_len,
+                                   hash128_t hash, bf::hash_id id)
+    : probes(0), data(data), data_len(data_len) {
+    std::fill(hashed, hashed + bf::num_hash_ids, false);
+    h[id] = hash;
+    hashed[id] = true;
+}
+
+bool marker_cache::probe(const bf_pair& b, probe_key& key) const {
+    // A filter still being loaded may hold anything
+    if (__atomic_load_n(&b.loading, __ATOMIC_ACQUIRE)) return true;
+    size_t num_stages = std::min(b.num_stages, max_stages);
+    for (size_t s = 0; s < num_stages; ++s) {
+        const bf::shm_bloom_filter stage = b.stages[s];
+        if (!in_slab(stage)) continue;
+        ++key.probes;
+        if (key.matches(stage)) return true;
+    }
+    return false;
+}
+
+bool marker_cache::summary_rules_out(size_t head, size_t i, time_t start,
+                                     probe_key& key, size_t& summary,
+                                     bool& ruled_out) const {
+    size_t num_filters = buf_->slots.size();
+    size_t s = buf_->slots[(head + i) % num_filters].summary;
+    if (s == summary) return ruled_out;
+    summary = s;
+    ruled_out = false;
+    // A summary costs a probe of its own, it only pays for itself if it
+    // spares the lookup several filters
+    if (s >= buf_->summaries.size() || i == 0) return false;
+    const bf_pair& older = buf_->slots[(head + i - 1) % num_filters];
+    if (older.summary != s || older.first.second < start) return false;
+    const bf::shm_bloom_filter filter = buf_->summaries[s].filter;
+    if (!in_slab(filter)) return false;
+    ++key.probes;
+    ruled_out = !key.matches(filter);
+    return ruled_out;
+}
+
+bool marker_cache::in_slab(const bf::shm_bloom_filter& filter) const {
+    const bf::block_t* slab = buf_->slab.get();
+    return filter.data() >= slab &&
+           filter.data() +
+                   bf::shm_bloom_filter::num_words(filter.size(),
+                                                   filter.blocked()) <=
+               slab + buf_->slab_words;
+}
+
+bool marker_cache::probe_key::matches(const bf::shm_bloom_filter& filter) {
+    bf::hash_id id = filter.hash_function();
+    if (id >= bf::num_hash_ids) return false;
+    if (!hashed[id]) {
+        if (!data) return true;
+        h[id] = bf::shm_bloom_filter::hash(data, data_len, id);
+        hashed[id] = true;
+    }
+    return filter.lookup(h[id]);
+}
+
+size_t marker_cache::filters_starting_by(time_t t) const {
+    // Filters are ordered by time and do not overlap, binary search the ring
+    // for the first filter starting after t
+    size_t head = buf_->head;
+    size_t num_filters = buf_->slots.size();
+    size_t lo = 0, hi = std::min(buf_->size, num_filters);
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (buf_->slots[(head + mid) % num_filters].first.first <= t)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+std::string marker_cache::segment_name(const std::string& name) {
+    return name.empty() ? "CacheSharedMemory" : "CacheSharedMemory_" + name;
+}
+
+std::string marker_cache::stats_name(const std::string& name) {
+    return segment_name(name) + "_stats";
+}
+
+boost::filesystem::path marker_cache::huge_page_path(const std::string& name) {
+    return boost::filesystem::path(huge_page_mount) / segment_name(name);
+}
+
+boost::filesystem::path marker_cache::archive_path(const std::string& name) {
+    boost::filesystem::path dir("archive");
+    return name.empty() ? dir : dir / name;
+}
+
+boost::filesystem::path marker_cache::timestamp_to_filepath(
+    time_t t, const char* extension, size_t stage) {
     std::ostringstream ss;
-    ss << archive_dir.string() << '/' << t << ".filter";
+    ss << archive_dir.string() << '/' << t;
+    if (stage > 0) ss << '-' << stage;
+    ss << extension;
     return ss.str();
 }
+
+bool marker_cache::is_stage_file(const boost::filesystem::path& path) {
+    return path.stem().string().find('-') != std::string::npos;
+}
@@ -1,14 +1,19 @@
 #ifndef MARKER_CACHE_H
 #define MARKER_CACHE_H
+#include <filterarchive.h>
 #include <shmbloomfilter.h>
-#include <boost/interprocess/containers/deque.hpp>
-#include <boost/interprocess/sync/interprocess_sharable_mutex.hpp>
-#include <boost/interprocess/sync/sharable_lock.hpp>
+#include <boost/interprocess/containers/vector.hpp>
+#include <boost/interprocess/managed_mapped_file.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <atomic>
+#include <condition_variable>
 #include <ctime>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <thread>
 
 #include <boost/archive/text_iarchive.hpp>
-#include <boost/archive/text_oarchive.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/serialization/utility.hpp>
 #include <fstream>
@@ -21,40 +26,275 @@
 #include <boost/log/utility/setup/file.hpp>
 
 class marker_cache {
-    // Internal-only representation of timeranges
+   public:
+    // A marker given by a pointer to its bytes and its length
+    typedef std::pair<const void *, int> marker;
+    // Inclusive [start, end] period, as taken by lookup_from
     typedef std::pair<time_t, time_t> timerange;
+
+   private:
+    // Most sub-filters a filter can be made of
+    static const size_t max_stages = 8;
+    // Summary of a filter which belongs to none
+    static const size_t no_summary = size_t(-1);
+
     struct bf_pair {
-        bf_pair(const bf::void_allocator &void_alloc) : second(void_alloc) {}
-        bf_pair(const timerange &f, const bf::shm_bloom_filter &s)
-            : first(f), second(s) {}
+        bf_pair()
+            : num_stages(0),
+              loading(false),
+              capacity(0),
+              folds(0),
+              summary(no_summary) {}
         timerange first;
-        bf::shm_bloom_filter second;
+        // Sub-filters over the same timerange, each chained once the one
+        // before it reached its design load. A marker may be in any of them.
+        bf::shm_bloom_filter stages[max_stages];
+        size_t num_stages;
+        // Set while the words are still being read from disk
+        bool loading;
+        // Design load of the first stage, only used by the owner
+        size_t capacity;
+        // Times the filter was folded in half since it was sealed
+        size_t folds;
+        // Summary filter holding every marker inserted into this filter
+        size_t summary;
 
         friend class boost::serialization::access;
         template <class Archive>
         void serialize(Archive &ar, const unsigned int version) {
             ar &first;
-            ar &second;
+            ar &stages[0];
         }
     };
 
     typedef bf::void_allocator::rebind<bf_pair>::other bf_pair_allocator;
-    typedef boost::interprocess::deque<bf_pair, bf_pair_allocator> cache_buffer;
+    typedef boost::interprocess::vector<bf_pair, bf_pair_allocator> slot_vector;
+
+    // Filter taking every insert made into a group of consecutive filters,
+    // a lookup it rules a marker out of can skip all of them
+    struct summary_filter {
+        summary_filter() : members(0) {}
+        bf::shm_bloom_filter filter;
+        // Filters which joined it, 0 while it is free. Only used by the
+        // owner.
+        size_t members;
+    };
+
+    typedef bf::void_allocator::rebind<summary_filter>::other
+        summary_allocator;
+    typedef boost::interprocess::vector<summary_filter, summary_allocator>
+        summary_vector;
+
+    // Run of free chunks of the slab, as its first chunk and length
+    typedef std::pair<size_t, size_t> extent;
+    typedef bf::void_allocator::rebind<extent>::other extent_allocator;
+    typedef boost::interprocess::vector<extent, extent_allocator>
+        extent_vector;
+
+    // Fixed ring of filters whose words are carved out of a single slab
+    // allocated when the cache is created. Ageing recycles the oldest slot
+    // and its words in place, the slab only has to be shared out differently
+    // when filters are chained extra stages.
+    // Readers take no locks, they retry a lookup if the generation changed
+    // while they were reading. The generation is odd while the owner is
+    // changing the ring (a seqlock).
+    struct cache_buffer {
+        cache_buffer(const bf::void_allocator &void_alloc)
+            : generation(0),
+              head(0),
+              size(0),
+              slots(void_alloc),
+              slab_words(0),
+              segment_bytes(0),
+              free_chunks(void_alloc),
+              summaries(void_alloc) {}
+
+        // i-th filter in use, counting from the oldest
+        bf_pair &at(size_t i) { return slots[(head + i) % slots.size()]; }
+
+        std::atomic<uint64_t> generation;
+        // Slot of the oldest filter and number of filters in use
+        size_t head;
+        size_t size;
+        slot_vector slots;
+        boost::interprocess::offset_ptr<bf::block_t> slab;
+        size_t slab_words;
+        // Size the segment was asked for, it may be rounded up to whole
+        // huge pages
+        size_t segment_bytes;
+        // Chunks of the slab changed since the last checkpoint, filters
+        // start on a chunk so each chunk belongs to a single filter
+        boost::interprocess::offset_ptr<bf::dirty_t> dirty;
+        // Sorted by first chunk, only used by the owner
+        extent_vector free_chunks;
+        // Carved out of the slab like the filters
+        summary_vector summaries;
+    };
 
     // API for managing shared memory and retrieving handles to data
    public:
+    // Optional behaviour chosen by the process that creates the cache
+    struct options {
+        options()
+            : blocked(false),
+              multi_writer(false),
+              checkpoint_interval(5),
+              lazy_load(false),
+              hash(bf::hash_murmur3),
+              stage_headroom(0),
+              adaptive_sizing(false),
+              fold_after(0),
+              max_folds(2),
+              summary_group(0),
+              compress_archives(false),
+              huge_pages(false),
+              stats(false) {}
+
+        // Map every marker to a single cache line of its filter so a lookup
+        // costs one cache miss per filter instead of up to k
+        bool blocked;
+
+        // Allow several DBApp threads to insert and age concurrently, bits
+        // are set with atomic word updates
+        bool multi_writer;
+
+        // Seconds between checkpoints of the chunks of the current filter
+        // changed since the last one, bounding what a crash loses. 0 disables
+        // checkpoints.
+        size_t checkpoint_interval;
+
+        // Serve as soon as the newest archived filter is loaded, the older
+        // ones are loaded in the background and answer maybe meanwhile
+        bool lazy_load;
+
+        // Hash function for new filters, archived filters keep the one they
+        // were built with
+        bf::hash_id hash;
+
+        // Several caches can run on a host under different names, each with
+        // its own segment and archive directory. The unnamed cache keeps the
+        // original names.
+        std::string name;
+
+        // Memory for the stages chained to filters which reach their design
+        // load before they are sealed, as a fraction of the memory of the
+        // filters themselves. Each stage holds twice as many markers as the
+        // one before at half the false positive rate, keeping the rate of
+        // the whole filter within twice the target. With none, filters keep
+        // taking inserts past their design load.
+        double stage_headroom;
+
+        // Size each new filter for the markers expected in its period, from
+        // those inserted at the same hours on earlier days and in the last
+        // period, instead of an even share of the total capacity. Memory
+        // left by quiet periods goes to busy ones, the slab stays the same.
+        bool adaptive_sizing;
+
+        // Fold each sealed filter in half, OR-ing its upper half into its
+        // lower half, once it has been sealed for fold_after periods and
+        // again every fold_after periods after that, up to max_folds times.
+        // Older periods cost less memory for a higher false positive rate,
+        // and the slab is only sized for the folded filters so a longer
+        // lifespan fits in the same memory. Filters are rounded up to a
+        // power of two bits to be foldable. 0 disables folding.
+        size_t fold_after;
+        size_t max_folds;
+
+        // Keep a summary filter for every summary_group consecutive filters,
+        // taking the inserts of all of them at the target false positive
+        // rate. A lookup spanning several filters of a group probes their
+        // summary first and skips them all if it rules the marker out. The
+        // summary of a group is dropped once its last filter is, so the
+        // summaries take about as much memory again as the filters. Filters
+        // loaded from disk belong to no group. 0 disables summaries.
+        size_t summary_group;
+
+        // Archive sparse filters, sealed early or over quiet periods, as the
+        // Rice coded gaps between their set bits. Each file is compressed
+        // only if its density makes it smaller, and is decoded straight into
+        // shared memory when it is loaded.
+        bool compress_archives;
+
+        // Back the segment with a file on the hugetlbfs mounted at
+        // /dev/hugepages so that random probes of large filters miss the TLB
+        // less. Without the mount, or free huge pages, the segment is POSIX
+        // shared memory as usual and its slab is advised to use transparent
+        // huge pages.
+        bool huge_pages;
+
+        // Count lookups, inserts, ageing cycles and disk writes, and time
+        // them, in a block of shared memory every process using the cache
+        // adds to. Timing costs two clock reads per call.
+        bool stats;
+    };
+
+    // Latencies are counted in buckets of powers of two nanoseconds, bucket
+    // b holding those in [2^(b-1), 2^b)
+    static const size_t num_latency_buckets = 40;
+
+    // Counters kept by every process using the cache since it was created
+    struct statistics {
+        // Markers looked up, those found in some filter and the filters and
+        // summaries probed for them
+        uint64_t lookups;
+        uint64_t hits;
+        uint64_t filters_probed;
+        // Markers inserted
+        uint64_t inserts;
+        uint64_t ageing_cycles;
+        // Filters written to disk and the time spent writing them
+        uint64_t saves;
+        uint64_t save_ns;
+        // One sample per call, a batch lookup or insert is a single sample.
+        // The lookup and insert histograms only add up to lookups and
+        // inserts when no batches were made.
+        uint64_t lookup_latency[num_latency_buckets];
+        uint64_t insert_latency[num_latency_buckets];
+        uint64_t age_latency[num_latency_buckets];
+        uint64_t save_latency[num_latency_buckets];
+    };
+
+    // Fill of a filter in the ring, over all its stages
+    struct filter_statistics {
+        timerange range;
+        size_t stages;
+        size_t bits;
+        size_t set_bits;
+        // Set bits over bits, and the false positive rate that gives
+        double fill;
+        double fp_rate;
+        // Nothing is known of a filter still being loaded
+        bool loading;
+    };
+    // Bytes of the segment and of the slab of filter words within it
+    struct memory_usage {
+        size_t allocated;
+        size_t used;
+        size_t free;
+        // Rounding of the segment up to whole huge pages, counted in neither
+        // used nor free
+        size_t page_slack;
+        size_t slab;
+        // Only known to the owner, readers see 0
+        size_t slab_free;
+        bool huge_pages;
+    };
+
     // Bloom filter duration and lifespan are given in minutes then converted to
     // seconds for internal use
     // The duration is long the Bloom filter is active for
     // The lifespan is how long the Bloom filter is held in memory for before
     // being deleted
     marker_cache(size_t min_filterduration, size_t min_filterlifespan,
-                 double fp, size_t total_capacity);
+                 double fp, size_t total_capacity,
+                 const options &opts = options());
 
     // Throws an exception if the memory is not active, reading process
-    marker_cache();
+    // Attaches to the cache created with options::name
+    explicit marker_cache(const std::string &name = std::string());
 
-    // Clear shared memory on exit if the process owns the memory
+    // Clear shared memory on exit if the process owns the memory, pending
+    // disk writes are finished first
     ~marker_cache();
 
     // Forbid copy construction
@@ -62,44 +302,345 @@ class marker_cache {
     marker_cache &operator=(marker_cache const &) = delete;
 
     // data_len is num of chars (bytes)
-    bool lookup_from(time_t start, time_t end, char *data, int data_len) const;
+    bool lookup_from(time_t start, time_t end, const void *data,
+                     int data_len) const;
+
+    // Look up a marker given by its hash under the hash function id, as
+    // computed by bf::shm_bloom_filter::hash. Filters built with another
+    // hash function can't be probed and answer maybe.
+    bool lookup_from(time_t start, time_t end, hash128_t hash,
+                     bf::hash_id id = bf::hash_murmur3) const;
+    // Look up a marker whose hash under id is already known, filters built
+    // with another hash function hash the data instead
+    bool lookup_from(time_t start, time_t end, const void *data, int data_len,
+                     hash128_t hash, bf::hash_id id) const;
+
+    // Look up a marker over several timeranges in one pass over the filters,
+    // bit i of the result is set if it may have been inserted in ranges[i]
+    boost::dynamic_bitset<> lookup_from(const timerange *ranges,
+                                        size_t num_ranges, const void *data,
+                                        int data_len) const;
+    boost::dynamic_bitset<> lookup_from(
+        const timerange *ranges, size_t num_ranges, hash128_t hash,
+        bf::hash_id id = bf::hash_murmur3) const;
+
+    // Timeranges of every filter the marker may have been inserted in,
+    // clipped to [start, end] and oldest first, so that only those periods
+    // need to be searched in the database. Empty if the marker is absent.
+    std::vector<timerange> lookup_ranges(time_t start, time_t end,
+                                         const void *data,
+                                         int data_len) const;
+    std::vector<timerange> lookup_ranges(
+        time_t start, time_t end, hash128_t hash,
+        bf::hash_id id = bf::hash_murmur3) const;
+
+    // Look up a batch of markers over the same timerange, bit i of the result
+    // is set if markers[i] may have been inserted
+    boost::dynamic_bitset<> lookup_from_batch(time_t start, time_t end,
+                                              const marker *markers,
+                                              size_t num_markers) const;
 
     // Insert into the most recent Bloom filter
-    void insert(char *data, int data_len);
+    void insert(const void *data, int data_len);
+
+    // Insert a batch of markers into the most recent Bloom filter, cheaper
+    // than repeated calls to insert for whole result sets
+    void insert_batch(const marker *markers, size_t num_markers);
 
     // DBAPP will call maybe_age() which can call age()
     // Takes a boolean parameter to force an ageing cycle, this should only be
     // used for testing purposes
+    // A cycle falling due while archived filters are still being loaded in
+    // the background is put off until they are, a forced one waits for them
     void maybe_age(bool force = false);
 
-    // Do a disk write of Bloom filters which have not been saved already
+    // Queue a disk write of Bloom filters which have not been saved already
+    // Writes happen on a background thread, ingest never waits on the disk
     void save();
 
+    // Wait until every queued disk write and removal has been done
+    void flush();
+
+    // Wait until every archived filter found at startup has been loaded
+    void wait_loaded();
+
+    memory_usage memory() const;
+
+    // Copy the counters, false if the owner does not keep them
+    bool stats(statistics &out) const;
+
+    // Fill of every filter in the ring, oldest first, found by counting
+    // their set bits
+    std::vector<filter_statistics> filter_stats() const;
+
    private:
-    // The shared memory object
-    boost::interprocess::managed_shared_memory *segment_;
+    // The segment is either POSIX shared memory or a file on hugetlbfs,
+    // only one of them is mapped
+    boost::interprocess::managed_shared_memory *shm_;
+    boost::interprocess::managed_mapped_file *hugetlb_;
+    bf::segment_manager_t *segment_;
     cache_buffer *buf_;
     bf::void_allocator get_allocator();
     bool owner_;
+    std::string segment_name_;
+
+    // Map a new segment of size bytes, on huge pages if asked for and
+    // available
+    void create_segment(size_t size);
+
+    // Counters in a segment of their own, which readers map read-write
+    // while the cache is read only to them
+    struct shared_stats {
+        std::atomic<uint64_t> lookups;
+        std::atomic<uint64_t> hits;
+        std::atomic<uint64_t> filters_probed;
+        std::atomic<uint64_t> inserts;
+        std::atomic<uint64_t> ageing_cycles;
+        std::atomic<uint64_t> saves;
+        std::atomic<uint64_t> save_ns;
+        std::atomic<uint64_t> lookup_latency[num_latency_buckets];
+        std::atomic<uint64_t> insert_latency[num_latency_buckets];
+        std::atomic<uint64_t> age_latency[num_latency_buckets];
+        std::atomic<uint64_t> save_latency[num_latency_buckets];
+    };
+
+    // NULL unless the owner keeps statistics
+    boost::interprocess::mapped_region *stats_region_;
+    shared_stats *stats_;
+    // Create the counters of the cache called name, or map those of its
+    // owner
+    void open_stats(const std::string &name);
+    // Count n markers looked up since started, hits of them found after
+    // probing probes filters
+    void count_lookups(uint64_t started, size_t n, size_t hits,
+                       size_t probes) const;
+
+    // Names of the segment, its statistics, its hugetlbfs file and the
+    // archive directory of the cache called name
+    static std::string segment_name(const std::string &name);
+    static std::string stats_name(const std::string &name);
+    static boost::filesystem::path huge_page_path(const std::string &name);
+    static boost::filesystem::path archive_path(const std::string &name);
+
+    // Filter receiving inserts, only used by the owning process
+    // Published after the filter is in the buffer so inserting threads never
+    // have to read the back of the ring while ageing modifies it
+    std::atomic<bf::shm_bloom_filter *> current_;
+    // Only one thread runs an ageing cycle, or chains a stage, at a time
+    std::mutex age_mutex_;
+    // Markers inserted into the current stage and its design load
+    std::atomic<size_t> inserted_;
+    std::atomic<size_t> stage_capacity_;
+    // Set when an insert could not chain a stage because the age mutex was
+    // held
+    std::atomic<bool> roll_over_retry_;
+
+    // Publish the last stage of b as the current filter
+    void make_current(bf_pair &b);
+    // Count n markers inserted into the current stage, true if they took it
+    // to its design load or a roll over is to be retried
+    bool count_inserts(size_t n);
+    // Chain a new stage to the filter whose current stage is full, unless
+    // the age mutex is held
+    void roll_over(bf::shm_bloom_filter *full);
+    // Bits, hash functions and design load of stage s of a filter whose
+    // first stage was designed for base markers
+    void stage_geometry(size_t s, size_t base, size_t &m, size_t &k,
+                        size_t &capacity) const;
+    // Markers a filter of m bits holds at the target false positive rate
+    size_t design_load(size_t m) const;
+
+    // Record the markers inserted into b over its period
+    void observe(const bf_pair &b);
+    // Markers expected in the period starting at t
+    size_t forecast(time_t t) const;
+    // Insert rates, in markers per second, seen at each hour of the day and
+    // in the last period, negative until a period was sealed. Only used by
+    // the owner under the age mutex.
+    double hourly_rate_[24];
+    bool hourly_seen_[24];
+    double recent_rate_;
 
     // Filter duration in seconds, specific to DBApp, won't be initialised on
     // the SD side
     time_t sec_filterduration;
 
-    bool overlapping_timerange(timerange fst, timerange snd) const;
+    // A key hashed on demand for each hash function it is probed with
+    class probe_key {
+       public:
+        probe_key(const void *data, int data_len);
+        probe_key(hash128_t hash, bf::hash_id id);
+        probe_key(const void *data, int data_len, hash128_t hash,
+                  bf::hash_id id);
+        // A key given only by its hash matches filters built with another
+        // hash function
+        bool matches(const bf::shm_bloom_filter &filter);
+        // Filters and summaries probed with the key
+        size_t probes;
+
+       private:
+        const void *data;
+        int data_len;
+        hash128_t h[bf::num_hash_ids];
+        bool hashed[bf::num_hash_ids];
+    };
+
+    // True if the marker may be in the filter, each stage is copied out of
+    // the ring and only probed if it lies within the slab since the owner
+    // may be replacing it
+    bool probe(const bf_pair &b, probe_key &key) const;
+    bool in_slab(const bf::shm_bloom_filter &filter) const;
+    // True if the summary of the i-th filter from head rules the key out.
+    // A summary is probed once per lookup, the last one probed and its
+    // answer are kept in summary and ruled_out, and only if the lookup
+    // reaches the filter before the i-th too.
+    bool summary_rules_out(size_t head, size_t i, time_t start,
+                           probe_key &key, size_t &summary,
+                           bool &ruled_out) const;
+
+    bool lookup_from(time_t start, time_t end, probe_key &key) const;
+    boost::dynamic_bitset<> lookup_from(const timerange *ranges,
+                                        size_t num_ranges,
+                                        probe_key &key) const;
+    std::vector<timerange> lookup_ranges(time_t start, time_t end,
+                                         probe_key &key) const;
+
+    // Number of filters, from the oldest, which start no later than t
+    // Only these can overlap a search period ending at t
+    size_t filters_starting_by(time_t t) const;
+
+    // Stages after the first are kept in files of their own, suffixed with
+    // the stage number
+    boost::filesystem::path timestamp_to_filepath(
+        time_t t, const char *extension = ".filter", size_t stage = 0);
+    static bool is_stage_file(const boost::filesystem::path &path);
+
+    // Ring updates, only made by the owner. A filter is cleared before it
+    // becomes visible to readers.
+    bf_pair &front() { return buf_->at(0); }
+    bf_pair &back() { return buf_->at(buf_->size - 1); }
+    // The new filter is designed for capacity markers
+    bf_pair &push_back(const timerange &t, size_t capacity);
+    bf_pair &push_front(const timerange &t, size_t capacity);
+    void pop_front();
+    // Add b to the open summary, opening a new one once it is full
+    void join_summary(bf_pair &b);
+    // Summary taking the markers inserted into stage, if any
+    bf::shm_bloom_filter *summary_of(const bf::shm_bloom_filter *stage);
+    // Give the slot a single empty stage designed for capacity markers, or
+    // as near as the memory left allows with adaptive sizing
+    void clear_slot(size_t slot, size_t capacity);
+
+    // Whole chunks of the slab, first filters are taken first-fit from the
+    // bottom and later stages last-fit from the top so that recycling a
+    // filter always leaves a hole the next first stage fits in
+    // Returns NULL if no run of free chunks is long enough, the slab is never
+    // compacted here since stages are allocated on the insert path
+    bf::block_t *allocate(size_t words, bool stage);
+    // Compact the slab if it has the free words but no run holds them. Only
+    // called when loading and ageing.
+    void make_room(size_t words);
+    void release(const bf::block_t *bits, size_t words);
+    // Free words in the slab and in its longest free run
+    size_t free_words() const;
+    size_t largest_run() const;
+    // Move sealed filters down into the free runs below them so that the
+    // free chunks left between them join up at the top of the slab
+    void compact();
+
+    // Folds a sealed filter should have had at age periods, the filter
+    // taking inserts being of age 0
+    size_t fold_target(size_t age) const;
+    // Fold every stage of b in half where it can be, in place, and give the
+    // upper halves back to the slab
+    void fold(bf_pair &b);
+    // Words taken from the slab by stage s of b
+    size_t stage_words(const bf_pair &b, size_t s) const;
+    void release_stages(bf_pair &b);
+
+    // Seqlock around changes to the ring
+    void write_begin();
+    void write_end();
+    // Start of a read, waits while the ring is being changed
+    uint64_t read_begin() const;
+    // True if the ring was not changed since read_begin
+    bool read_validate(uint64_t generation) const;
+
+    // Disk work handed to the persistence thread, either writing the sealed
+    // filter held in slot or removing the archive of an outdated filter
+    struct persist_job {
+        bool remove;
+        size_t slot;
+        timerange range;
+        // Write even if the filter was archived already, it changed since
+        bool rewrite;
+    };
+
+    void persist(const persist_job &job);
+    // Queue a job, with the persist mutex held. A write to a slot supersedes
+    // any write already queued for it.
+    void queue(const persist_job &job);
+    void persist_loop();
+    // Write the chunks of the current filter changed since the last
+    // checkpoint, or all of them for a new filter
+    void checkpoint();
+    // True if slot currently holds the filter covering range, which is then
+    // copied to snapshot if given
+    bool holds(size_t slot, const timerange &range,
+               bf_pair *snapshot = NULL) const;
+
+    // Jobs are coalesced per slot and the queue is bounded, the oldest write
+    // is dropped if the disk falls behind by more than a full ring, removals
+    // never are
+    std::deque<persist_job> persist_queue_;
+    std::mutex persist_mutex_;
+    std::condition_variable persist_cv_;
+    std::condition_variable persist_done_cv_;
+    bool persist_busy_;
+    bool persist_stop_;
+    std::thread persist_thread_;
+    // Filter covered by the checkpoint files, its stages with a file and
+    // the bytes appended to them, only used by the persistence thread
+    timerange checkpoint_range_;
+    size_t checkpoint_stages_;
+    size_t checkpoint_bytes_;
+
+    // Archived filter to read into a slot whose headers are already
+    // published, one file per stage
+    struct load_job {
+        size_t slot;
+        std::vector<std::string> paths;
+        bool checkpoint;
+    };
 
-    boost::filesystem::path timestamp_to_filepath(time_t t);
+    void load(const load_job &job);
+    void load_loop();
 
-    boost::interprocess::interprocess_sharable_mutex *mutex;
+    std::vector<load_job> load_jobs_;
+    std::atomic<size_t> load_next_;
+    size_t load_done_;
+    std::vector<std::thread> loaders_;
+    std::mutex load_mutex_;
+    std::condition_variable load_cv_;
 
     boost::filesystem::path archive_dir;
 
-    boost::log::sources::severity_logger<boost::log::trivial::severity_level>
+    boost::log::sources::severity_logger_mt<boost::log::trivial::severity_level>
         lg;
 
     // Bloom filter paramters
     size_t k;
     size_t filter_size;
+    // Words kept free for chained stages when sizing adaptively
+    size_t stage_reserve_;
+    // Geometry of the summaries and the one filters join, owner only
+    size_t summary_size_;
+    size_t summary_k_;
+    size_t open_summary_;
+    // Target false positive rate and design load of a first stage
+    double fp_;
+    size_t filter_capacity_;
+    options opts_;
 };
 
 #endif
\ No newline at end of file
@@ -66,45 +66,44 @@ FORCE_INLINE uint64_t fmix64(uint64_t k) {
 }
 
 //-----------------------------------------------------------------------------
+// Body and tail of the x64 128-bit hash, shared by the scalar and the
+// interleaved versions
 
-hash128_t MurmurHash3_x64_128(const void *key, const int len,
-                              const uint32_t seed) {
-    const uint8_t *data = (const uint8_t *)key;
-    const int nblocks = len / 16;
-
-    uint64_t h1 = seed;
-    uint64_t h2 = seed;
+static const uint64_t c1 = BIG_CONSTANT(0x87c37b91114253d5);
+static const uint64_t c2 = BIG_CONSTANT(0x4cf5ad432745937f);
 
-    const uint64_t c1 = BIG_CONSTANT(0x87c37b91114253d5);
-    const uint64_t c2 = BIG_CONSTANT(0x4cf5ad432745937f);
+FORCE_INLINE void mix_block(uint64_t &h1, uint64_t &h2, uint64_t k1,
+                            uint64_t k2) {
+    k1 *= c1;
+    k1 = ROTL64(k1, 31);
+    k1 *= c2;
+    h1 ^= k1;
 
-    //----------
-    // body
-
-    const uint64_t *blocks = (const uint64_t *)(data);
+    h1 = ROTL64(h1, 27);
+    h1 += h2;
+    h1 = h1 * 5 + 0x52dce729;
 
-    for (int i = 0; i < nblocks; i++) {
-        uint64_t k1 = getblock64(blocks, i * 2 + 0);
-        uint64_t k2 = getblock64(blocks, i * 2 + 1);
+    k2 *= c2;
+    k2 = ROTL64(k2, 33);
+    k2 *= c1;
+    h2 ^= k2;
 
-        k1 *= c1;
-        k1 = ROTL64(k1, 31);
-        k1 *= c2;
-        h1 ^= k1;
+    h2 = ROTL64(h2, 31);
+    h2 += h1;
+    h2 = h2 * 5 + 0x38495ab5;
+}
 
-        h1 = ROTL64(h1, 27);
-        h1 += h2;
-        h1 = h1 * 5 + 0x52dce729;
+FORCE_INLINE hash128_t finish(const uint8_t *data, const int len, int block,
+                              uint64_t h1, uint64_t h2) {
+    const int nblocks = len / 16;
+    const uint64_t *blocks = (const uint64_t *)(data);
 
-        k2 *= c2;
-        k2 = ROTL64(k2, 33);
-        k2 *= c1;
-        h2 ^= k2;
+    //----------
+    // body, from the first block not yet mixed
 
-        h2 = ROTL64(h2, 31);
-        h2 += h1;
-        h2 = h2 * 5 + 0x38495ab5;
-    }
+    for (int i = block; i < nblocks; i++)
+        mix_block(h1, h2, getblock64(blocks, i * 2 + 0),
+                  getblock64(blocks, i * 2 + 1));
 
     //----------
     // tail
@@ -181,3 +180,38 @@ hash128_t MurmurHash3_x64_128(const void *key, const int len,
 }
 
 //-----------------------------------------------------------------------------
+
+hash128_t MurmurHash3_x64_128(const void *key, const int len,
+                              const uint32_t seed) {
+    return finish((const uint8_t *)key, len, 0, seed, seed);
+}
+
+//-----------------------------------------------------------------------------
+// Four keys hashed in lockstep over the blocks they have in common, the
+// independent lanes keep the multipliers busy while each lane waits on its
+// own dependency chain. Results are identical to the scalar version.
+
+void MurmurHash3_x64_128_x4(const void *const keys[4], const int lens[4],
+                            const uint32_t seed, hash128_t out[4]) {
+    const uint64_t *blocks[4];
+    uint64_t h1[4], h2[4];
+    int common = lens[0] / 16;
+
+    for (int l = 0; l < 4; l++) {
+        blocks[l] = (const uint64_t *)keys[l];
+        h1[l] = seed;
+        h2[l] = seed;
+        if (lens[l] / 16 < common) common = lens[l] / 16;
+    }
+
+    for (int i = 0; i < common; i++)
+        for (int l = 0; l < 4; l++)
+            mix_block(h1[l], h2[l], getblock64(blocks[l], i * 2 + 0),
+                      getblock64(blocks[l], i * 2 + 1));
+
+    for (int l = 0; l < 4; l++)
+        out[l] =
+            finish((const uint8_t *)keys[l], lens[l], common, h1[l], h2[l]);
+}
+
+//-----------------------------------------------------------------------------
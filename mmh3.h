@@ -32,6 +32,10 @@ struct hash128_t {
 
 hash128_t MurmurHash3_x64_128(const void* key, int len, uint32_t seed);
 
+// Hashes four keys at once, equivalent to four calls of the above
+void MurmurHash3_x64_128_x4(const void* const keys[4], const int lens[4],
+                            uint32_t seed, hash128_t out[4]);
+
 //-----------------------------------------------------------------------------
 
 #endif  // _MURMURHASH3_H_
\ No newline at end of file
@@ -0,0 +1,73 @@
+#include "mumhash.h"
+#include <string.h>
+
+//-----------------------------------------------------------------------------
+// Odd constants with balanced bits, as used by wyhash
+
+static const uint64_t p0 = 0xa0761d6478bd642fULL;
+static const uint64_t p1 = 0xe7037ed1a0b428dbULL;
+static const uint64_t p2 = 0x8ebc6af09c88c6e3ULL;
+static const uint64_t p3 = 0x589965cc75374cc3ULL;
+
+// Full 128-bit product of a and b folded onto 64 bits
+static inline uint64_t mum(uint64_t a, uint64_t b) {
+    unsigned __int128 r = (unsigned __int128)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static inline uint64_t read64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+//-----------------------------------------------------------------------------
+
+hash128_t MumHash_x64_128(const void* key, const int len, uint32_t seed) {
+    const uint8_t* data = (const uint8_t*)key;
+    uint64_t h1 = seed ^ p0;
+    uint64_t h2 = seed ^ p1;
+
+    //----------
+    // body, two lanes of 16 bytes
+
+    int i = 0;
+    for (; i + 32 <= len; i += 32) {
+        h1 = mum(read64(data + i) ^ p1, read64(data + i + 8) ^ h1);
+        h2 = mum(read64(data + i + 16) ^ p2, read64(data + i + 24) ^ h2);
+    }
+
+    //----------
+    // tail, read with overlapping loads instead of copying, the length tells
+    // the overlaps apart
+
+    const uint8_t* tail = data + i;
+    int r = len - i;
+    if (r > 16) {
+        h1 = mum(read64(tail) ^ p1, read64(tail + 8) ^ h1);
+        h2 = mum(read64(tail + r - 16) ^ p2, read64(tail + r - 8) ^ h2);
+    } else if (r >= 8) {
+        h1 = mum(read64(tail) ^ p1, read64(tail + r - 8) ^ h1);
+    } else if (r >= 4) {
+        h1 = mum((read32(tail) << 32 | read32(tail + r - 4)) ^ p1, h1);
+    } else if (r > 0) {
+        uint64_t v = (uint64_t)tail[0] << 16 | (uint64_t)tail[r >> 1] << 8 |
+                     tail[r - 1];
+        h1 = mum(v ^ p1, h1);
+    }
+
+    //----------
+    // finalization, both halves depend on both lanes
+
+    uint64_t a = mum(h1 ^ p2, h2 ^ p3 ^ (uint64_t)len);
+    hash128_t out = {mum(a ^ p0, h1 ^ p1), mum(a ^ p1, h2 ^ p2)};
+    return out;
+}
+
+//-----------------------------------------------------------------------------
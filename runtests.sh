@@ -1,9 +1,18 @@
 rm -f DBAppUnitTests
-g++ -o DBAppUnitTests DBAppUnitTests.cpp markercache.cpp shmbloomfilter.cpp mmh3.cpp -I./ -std=c++0x -lrt -pthread
+g++ -o DBAppUnitTests DBAppUnitTests.cpp markercache.cpp cacherouter.cpp shmbloomfilter.cpp filterarchive.cpp mmh3.cpp mumhash.cpp -I./ -std=c++0x -lrt -pthread
 chmod 777 DBAppUnitTests
 rm -f SDUnitTests
-g++ -o SDUnitTests SDUnitTests.cpp markercache.cpp shmbloomfilter.cpp mmh3.cpp -I./ -std=c++0x -lrt -pthread
+g++ -o SDUnitTests SDUnitTests.cpp markercache.cpp cacherouter.cpp shmbloomfilter.cpp filterarchive.cpp mmh3.cpp mumhash.cpp -I./ -std=c++0x -lrt -pthread
 chmod 777 SDUnitTests
 rm -f TestingSHM
-g++ -o TestingSHM TestingSHM.cpp markercache.cpp shmbloomfilter.cpp mmh3.cpp -I./ -std=c++0x -lrt -pthread
+g++ -o TestingSHM TestingSHM.cpp markercache.cpp cacherouter.cpp shmbloomfilter.cpp filterarchive.cpp mmh3.cpp mumhash.cpp -I./ -std=c++0x -lrt -pthread
 chmod 777 TestingSHM
+rm -f CacheStats
+g++ -o CacheStats CacheStats.cpp markercache.cpp cacherouter.cpp shmbloomfilter.cpp filterarchive.cpp mmh3.cpp mumhash.cpp -I./ -std=c++0x -lrt -pthread
+chmod 777 CacheStats
+rm -f CacheBench
+g++ -o CacheBench CacheBench.cpp markercache.cpp cacherouter.cpp shmbloomfilter.cpp filterarchive.cpp mmh3.cpp mumhash.cpp -I./ -std=c++0x -O2 -lrt -pthread
+chmod 777 CacheBench
+rm -f ContentionBench
+g++ -o ContentionBench ContentionBench.cpp markercache.cpp cacherouter.cpp shmbloomfilter.cpp filterarchive.cpp mmh3.cpp mumhash.cpp -I./ -std=c++0x -O2 -lrt -pthread
+chmod 777 ContentionBench
@@ -1,28 +1,178 @@
 #include <shmbloomfilter.h>
+#include <bloomkernels.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
 
 namespace bf {
-shm_bloom_filter::shm_bloom_filter(const void_allocator& void_alloc, size_t m,
-                                   size_t k)
-    : bits_(m, false, void_alloc), num_hashes(k) {}
+// Kernels for every k up to max_kernel_k are instantiated, filters with more
+// hash functions use the K = 0 kernels
+static const int max_kernel_k = 16;
 
-shm_bloom_filter::shm_bloom_filter(const void_allocator& void_alloc)
-    : bits_(void_alloc) {}
+namespace {
+
+struct filter_ops {
+    bool (*lookup)(const block_t*, size_t, int, hash128_t);
+    void (*insert)(block_t*, size_t, int, hash128_t, bool, dirty_t*);
+    void (*prefetch)(const block_t*, size_t, int, hash128_t);
+};
+
+// Indexed by layout, reduction and k
+struct kernel_table {
+    filter_ops ops[2][3][max_kernel_k + 1];
+
+    template <template <int, class, class> class Kernel, class Reduce, int K>
+    struct fill {
+        static void run(filter_ops* ops) {
+            filter_ops o = {&Kernel<K, block_t, Reduce>::lookup,
+                            &Kernel<K, block_t, Reduce>::insert,
+                            &Kernel<K, block_t, Reduce>::prefetch};
+            ops[K] = o;
+            fill<Kernel, Reduce, K - 1>::run(ops);
+        }
+    };
+    template <template <int, class, class> class Kernel, class Reduce>
+    struct fill<Kernel, Reduce, -1> {
+        static void run(filter_ops*) {}
+    };
+
+    kernel_table() {
+        fill<classic_kernel, modulo_reduce, max_kernel_k>::run(
+            ops[0][reduce_modulo]);
+        fill<classic_kernel, mask_reduce, max_kernel_k>::run(
+            ops[0][reduce_mask]);
+        fill<classic_kernel, multiply_shift_reduce, max_kernel_k>::run(
+            ops[0][reduce_multiply_shift]);
+        fill<blocked_kernel, modulo_reduce, max_kernel_k>::run(
+            ops[1][reduce_modulo]);
+        fill<blocked_kernel, mask_reduce, max_kernel_k>::run(
+            ops[1][reduce_mask]);
+        fill<blocked_kernel, multiply_shift_reduce, max_kernel_k>::run(
+            ops[1][reduce_multiply_shift]);
+    }
+};
+
+// Function pointers are only valid in this process, filters in shared memory
+// only record what they need and look their kernels up on every call
+const kernel_table kernels;
+
+inline const filter_ops& ops(bool blocked, uint8_t reduction, int k) {
+    return kernels.ops[blocked][reduction][k <= max_kernel_k ? k : 0];
+}
+
+}  // namespace
+
+shm_bloom_filter::shm_bloom_filter()
+    : bits_(0),
+      num_bits(0),
+      num_hashes(0),
+      blocked_(false),
+      reduction_(reduce_modulo),
+      hash_(hash_murmur3),
+      dirty_(0) {}
+
+shm_bloom_filter::shm_bloom_filter(block_t* bits, size_t m, size_t k,
+                                   bool blocked, hash_id hash)
+    : bits_(bits),
+      num_bits(m),
+      num_hashes(k),
+      blocked_(blocked),
+      hash_(hash),
+      dirty_(0) {
+    if (blocked_) num_bits = num_words(m, true) * bits_per_block_t;
+    size_t n = blocked_ ? num_bits / cache_line_bits : num_bits;
+    reduction_ = (n & (n - 1)) == 0 ? reduce_mask : reduce_multiply_shift;
+}
+
+shm_bloom_filter::shm_bloom_filter(block_t* bits, size_t m, size_t k,
+                                   bool blocked, reduction_t reduction,
+                                   hash_id hash)
+    : bits_(bits),
+      num_bits(m),
+      num_hashes(k),
+      blocked_(blocked),
+      reduction_(reduction),
+      hash_(hash),
+      dirty_(0) {
+    if (blocked_) num_bits = num_words(m, true) * bits_per_block_t;
+}
 
 bool shm_bloom_filter::lookup(hash128_t hash) const {
-    for (int i = 0; i < num_hashes; ++i)
-        if (!bits_[(hash.h1 + i * hash.h2) % bits_.size()]) return false;
-    return true;
+    return ops(blocked_, reduction_, num_hashes)
+        .lookup(bits_.get(), num_bits, num_hashes, hash);
 }
 
-void shm_bloom_filter::insert(hash128_t hash) {
-    for (int i = 0; i < num_hashes; ++i)
-        bits_[(hash.h1 + i * hash.h2) % bits_.size()] = true;
+void shm_bloom_filter::insert(hash128_t hash, bool concurrent) {
+    ops(blocked_, reduction_, num_hashes)
+        .insert(bits_.get(), num_bits, num_hashes, hash, concurrent,
+                dirty_.get());
 }
 
-hash128_t shm_bloom_filter::hash(char* data, int data_len) {
+hash128_t shm_bloom_filter::hash(const void* data, int data_len, hash_id id) {
+    if (id == hash_mum) return MumHash_x64_128(data, data_len, 0);
     return MurmurHash3_x64_128(data, data_len, 0);
 }
 
-void shm_bloom_filter::reset() { bits_.reset(); }
+void shm_bloom_filter::hash(const void* const* data, const int* data_len,
+                            size_t n, hash128_t* out, hash_id id) {
+    size_t i = 0;
+    if (id == hash_mum) {
+        for (; i < n; ++i) out[i] = MumHash_x64_128(data[i], data_len[i], 0);
+        return;
+    }
+    for (; i + 4 <= n; i += 4)
+        MurmurHash3_x64_128_x4(data + i, data_len + i, 0, out + i);
+    for (; i < n; ++i) out[i] = MurmurHash3_x64_128(data[i], data_len[i], 0);
+}
+
+void shm_bloom_filter::prefetch(hash128_t hash) const {
+    ops(blocked_, reduction_, num_hashes)
+        .prefetch(bits_.get(), num_bits, num_hashes, hash);
+}
+
+void shm_bloom_filter::reset() {
+    std::fill(bits_.get(), bits_.get() + num_words(), block_t(0));
+}
+
+size_t shm_bloom_filter::num_words(size_t m, bool blocked) {
+    if (blocked)
+        return (m + cache_line_bits - 1) / cache_line_bits * words_per_line;
+    return (m + bits_per_block_t - 1) / bits_per_block_t;
+}
+
+double shm_bloom_filter::fp_rate(size_t m, size_t n, size_t k, bool blocked) {
+    // Classic approximation for a filter with uniformly scattered bits
+    // p = (1 - e^(-kn/m))^k
+    if (!blocked) return std::pow(1 - std::exp(-(double)k * n / m), (double)k);
+
+    // A blocked filter behaves like a set of small classic filters whose loads
+    // follow a Poisson distribution - Putze, Sanders & Singler 2007
+    double blocks = (double)m / cache_line_bits;
+    double lambda = n / blocks;
+    double p = 0;
+    double poisson = std::exp(-lambda);
+    size_t limit = lambda + 10 * std::sqrt(lambda) + 10;
+    for (size_t i = 0; i <= limit; ++i) {
+        p += poisson * std::pow(1 - std::pow(1 - 1.0 / cache_line_bits,
+                                             (double)(k * i)),
+                                (double)k);
+        poisson *= lambda / (i + 1);
+    }
+    return p;
+}
+
+size_t shm_bloom_filter::estimated_size() const {
+    // n = -(m/k)ln(1 - x/m) for x bits set - Swamidass & Baldi 2007
+    size_t x = set_bits();
+    if (x >= num_bits) return (std::numeric_limits<size_t>::max)();
+    return -((double)num_bits / num_hashes) * std::log1p(-(double)x / num_bits);
+}
+
+size_t shm_bloom_filter::set_bits() const {
+    size_t x = 0;
+    for (size_t i = 0; i < num_words(); ++i)
+        x += __builtin_popcountll(bits_.get()[i]);
+    return x;
+}
 
-}  // namespace bf
\ No newline at end of file
+}  // namespace bf
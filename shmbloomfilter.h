@@ -3,10 +3,16 @@
 
 #define BOOST_DATE_TIME_NO_LIB
 #include <mmh3.h>
+#include <mumhash.h>
 #include <boost/dynamic_bitset.hpp>
 #include <boost/interprocess/allocators/allocator.hpp>
 #include <boost/interprocess/managed_shared_memory.hpp>
+#include <boost/interprocess/offset_ptr.hpp>
+#include <boost/serialization/split_member.hpp>
 #include <boost/serialization/vector.hpp>
+#include <boost/serialization/version.hpp>
+#include <atomic>
+#include <stdexcept>
 
 namespace bf {
 
@@ -15,35 +21,145 @@ typedef boost::interprocess::managed_shared_memory::segment_manager
 typedef boost::interprocess::allocator<void, segment_manager_t> void_allocator;
 
 typedef size_t block_t;
-// Do rebinds to allow changing the base void_allocator
-typedef void_allocator::rebind<block_t>::other block_allocator;
-typedef boost::dynamic_bitset<block_t, block_allocator> bitset;
 
+// Size of a cache line, every block in the blocked layout fits in exactly one
+const size_t cache_line_bytes = 64;
+const size_t cache_line_bits = 8 * cache_line_bytes;
+const size_t bits_per_block_t = 8 * sizeof(block_t);
+const size_t words_per_line = cache_line_bits / bits_per_block_t;
+
+// Changes to a filter are tracked per chunk of a page of words
+const size_t chunk_words = 4096 / sizeof(block_t);
+typedef std::atomic<uint8_t> dirty_t;
+
+// How a hash is reduced onto the bits, or the cache lines, of a filter.
+// Filters written before the reductions were introduced use modulo.
+enum reduction_t {
+    reduce_modulo = 0,
+    reduce_mask = 1,
+    reduce_multiply_shift = 2
+};
+
+// Hash function keys are mapped with. A filter is only ever probed with the
+// hash it was built with, filters written before the choice was recorded use
+// MurmurHash3.
+enum hash_id { hash_murmur3 = 0, hash_mum = 1 };
+const int num_hash_ids = 2;
+
+// A Bloom filter over words it does not own. In the cache the words are
+// carved out of a slab allocated once in shared memory, so copies are shallow
+// and resetting a filter is the only way to recycle it.
 class shm_bloom_filter {
    public:
-    shm_bloom_filter(const void_allocator& void_alloc, size_t m, size_t k);
-    shm_bloom_filter(const void_allocator& void_alloc);
+    shm_bloom_filter();
+    // m is the number of bits and k the number of hash functions, bits must
+    // hold num_words(m, blocked) words
+    // In the blocked layout each key is mapped to a single cache line and all
+    // k bits are set within it, bits must then be cache line aligned
+    // Hashes are reduced with a mask when the filter is a power of two and a
+    // multiply-shift otherwise, never with a division
+    shm_bloom_filter(block_t* bits, size_t m, size_t k, bool blocked = false,
+                     hash_id hash = hash_murmur3);
+    // Filter with a given reduction, for filters read back from disk
+    shm_bloom_filter(block_t* bits, size_t m, size_t k, bool blocked,
+                     reduction_t reduction, hash_id hash = hash_murmur3);
+
+    // Flag dirty[c] whenever insert sets a new bit in chunk c of the words,
+    // dirty must hold num_chunks(m, blocked) flags
+    void track(dirty_t* dirty) { dirty_ = dirty; }
 
     bool lookup(hash128_t hash) const;
-    void insert(hash128_t hash);
-    static hash128_t hash(char* data, int data_len);
+    // With concurrent set, bits are set with atomic fetch-or so that several
+    // threads may insert into the same filter without losing updates
+    void insert(hash128_t hash, bool concurrent = false);
+    static hash128_t hash(const void* data, int data_len,
+                          hash_id id = hash_murmur3);
+    // Hashes n keys, MurmurHash3 interleaves them four at a time
+    static void hash(const void* const* data, const int* data_len, size_t n,
+                     hash128_t* out, hash_id id = hash_murmur3);
+
+    // Hint the cache about the words a later lookup of this hash will touch
+    void prefetch(hash128_t hash) const;
 
     void reset();
 
+    // Number of words holding a filter of m bits, the blocked layout rounds
+    // m up to a whole number of cache lines
+    static size_t num_words(size_t m, bool blocked);
+    // Number of chunks covering those words
+    static size_t num_chunks(size_t m, bool blocked) {
+        return (num_words(m, blocked) + chunk_words - 1) / chunk_words;
+    }
+
+    // Expected false positive rate of a filter of m bits holding n elements
+    static double fp_rate(size_t m, size_t n, size_t k, bool blocked);
+
+    // Number of keys inserted, estimated from the fraction of bits set
+    size_t estimated_size() const;
+    size_t set_bits() const;
+
+    const block_t* data() const { return bits_.get(); }
+    block_t* data() { return bits_.get(); }
+    size_t size() const { return num_bits; }
+    int hashes() const { return num_hashes; }
+    bool blocked() const { return blocked_; }
+    reduction_t reduction() const { return (reduction_t)reduction_; }
+    // Hash keys must be mapped with before insert and lookup
+    hash_id hash_function() const { return (hash_id)hash_; }
+
    private:
-    bitset bits_;
-    int num_hashes;
+    size_t num_words() const { return num_words(num_bits, blocked_); }
 
+    boost::interprocess::offset_ptr<block_t> bits_;
+    size_t num_bits;
+    int num_hashes;
+    bool blocked_;
+    uint8_t reduction_;
+    uint8_t hash_;
+    boost::interprocess::offset_ptr<dirty_t> dirty_;
+
+    // Text archives are only read for filters written before the binary
+    // format, they are loaded in place and must have the same number of bits
+    // as the words they are loaded into
     friend class boost::serialization::access;
     template <class Archive>
-    void serialize(Archive& ar, const unsigned int version) {
-        ar& bits_;
+    void save(Archive& ar, const unsigned int version) const {
+        std::vector<block_t> blocks(bits_.get(), bits_.get() + num_words());
+        ar& num_bits& blocks;
         ar& num_hashes;
+        ar& blocked_;
     }
+    template <class Archive>
+    void load(Archive& ar, const unsigned int version) {
+        std::vector<block_t> blocks;
+        size_t m;
+        if (version == 0) {
+            // Filters written before the blocked layout stored a bitset
+            boost::dynamic_bitset<block_t> bs;
+            ar& bs;
+            ar& num_hashes;
+            m = bs.size();
+            blocks.resize(bs.num_blocks());
+            to_block_range(bs, blocks.begin());
+            blocked_ = false;
+        } else {
+            ar& m& blocks;
+            ar& num_hashes;
+            ar& blocked_;
+        }
+        reduction_ = reduce_modulo;
+        hash_ = hash_murmur3;
+        if (m != num_bits || blocks.size() != num_words())
+            throw std::length_error("Archived filter has a different size");
+        std::copy(blocks.begin(), blocks.end(), bits_.get());
+    }
+    BOOST_SERIALIZATION_SPLIT_MEMBER()
 };
 
 }  // namespace bf
 
+BOOST_CLASS_VERSION(bf::shm_bloom_filter, 1)
+
 // Serialization support for dynamic_bitset
 namespace boost {
 namespace serialization {